@@ -0,0 +1,84 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+
+#define MPOL_BIND 2
+
+// Parses a CPU list in the kernel's format, like "0-3,8,10-11", into
+// set.  Returns false if it is malformed or names a CPU beyond what a
+// cpu_set_t holds.
+bool
+affinity_parse(const char *list, cpu_set_t *set) {
+    const char *p = list;
+
+    CPU_ZERO(set);
+    do {
+        char *endp;
+        long first = strtol(p, &endp, 10);
+        long last = first;
+        if (endp == p || first < 0) {
+            return false;
+        }
+        p = endp;
+        if (*p == '-') {
+            last = strtol(p + 1, &endp, 10);
+            if (endp == p + 1 || last < first) {
+                return false;
+            }
+            p = endp;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+    } while (*p++ == ',');
+    return p[-1] == '\0' || (p[-1] == '\n' && *p == '\0');
+}
+
+// Finds the CPUs belonging to a NUMA node.
+bool
+affinity_node_cpus(int node, cpu_set_t *set) {
+    char path[64], buf[4096];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    if (!ok || !affinity_parse(buf, set)) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+// Restricts memory allocation to a NUMA node.  The policy is
+// inherited by every child started afterwards, and survives exec.
+bool
+affinity_bind_node(int node) {
+    unsigned long mask[16] = { 0 };
+    int bits = 8 * sizeof(unsigned long);
+
+    if (node < 0 || node >= 16 * bits) {
+        errno = EINVAL;
+        return false;
+    }
+    mask[node / bits] = 1UL << (node % bits);
+#ifdef SYS_set_mempolicy
+    return syscall(SYS_set_mempolicy, MPOL_BIND, mask, 16 * bits + 1) == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
@@ -0,0 +1,11 @@
+#ifndef REPEAT_AFFINITY_H
+#define REPEAT_AFFINITY_H
+
+#include <sched.h>
+#include <stdbool.h>
+
+bool affinity_parse(const char *list, cpu_set_t *set);
+bool affinity_node_cpus(int node, cpu_set_t *set);
+bool affinity_bind_node(int node);
+
+#endif
@@ -0,0 +1,357 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "args.h"
+#include "evloop.h"
+#include "shell.h"
+
+// Input to --args-from is read into one buffer, and each invocation
+// takes its arguments as lines straight out of it.  A pipe is read as
+// the main loop finds it readable, and stops being read once enough is
+// buffered to keep every job busy; a file is read when it's needed.
+#define ARGS_READ 65536
+#define ARGS_HIGH_WATER (1 << 20)
+
+static int args_fd = -1;
+static bool from_file;          // a regular file, which epoll can't wait on
+static bool in_loop = false;    // args_fd is in the event loop
+static bool at_eof = false;
+static uint64_t args_tag;
+static char *buf = NULL;
+static size_t buf_size = 0;
+static size_t buf_start = 0;    // of the lines not yet taken
+static size_t buf_len = 0;
+static char **taken = NULL;
+static size_t *taken_len = NULL;
+static int taken_size = 0;
+
+// The command is turned once into a list of its words, noting which
+// have a {} to fill in, and each invocation's argument vector or shell
+// request is built in an arena kept from one to the next, so that once
+// it's big enough nothing is allocated or measured again.
+struct slot {
+    const char *word;
+    size_t len;
+    size_t prefix;          // up to the {}, if placed
+    bool placed;
+};
+
+static struct slot *slots = NULL;
+static int nslots = 0;
+static int nplaced = 0;
+static size_t fixed_size = 0;   // of the words without {}, with their NULs
+static size_t placed_size = 0;  // of the words with, less the {}s
+static char *arena = NULL;
+static size_t arena_size = 0;
+
+// Opens path, or standard input for "-", to take arguments from.
+// When it must be waited for, it's added to the event loop with kind.
+bool
+args_open(const char *path, int kind) {
+    struct stat st;
+
+    args_fd = (strcmp(path, "-") == 0) ? fcntl(0, F_DUPFD_CLOEXEC, 3)
+                                       : open(path, O_RDONLY | O_CLOEXEC);
+    if (args_fd < 0 || fstat(args_fd, &st) < 0) {
+        return false;
+    }
+    from_file = S_ISREG(st.st_mode);
+    if (from_file) {
+        return true;
+    }
+    fcntl(args_fd, F_SETFL, fcntl(args_fd, F_GETFL) | O_NONBLOCK);
+    args_tag = EV_TAG(kind, 0);
+    in_loop = ev_add(args_fd, args_tag);
+    return in_loop;
+}
+
+static void
+stop_reading(void) {
+    if (in_loop) {
+        ev_del(args_fd);
+        in_loop = false;
+    }
+}
+
+// Reads whatever is available into the buffer.
+static void
+fill(void) {
+    if (buf_start > 0) {
+        buf_len -= buf_start;
+        memmove(buf, buf + buf_start, buf_len);
+        buf_start = 0;
+    }
+    if (buf_size - buf_len < ARGS_READ) {
+        char *grown = realloc(buf, buf_len + ARGS_READ);
+        if (grown == NULL) {
+            return;
+        }
+        buf = grown;
+        buf_size = buf_len + ARGS_READ;
+    }
+    ssize_t len = read(args_fd, buf + buf_len, buf_size - buf_len);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0) {
+        // An error ends the arguments the same as the end of input
+        at_eof = true;
+        stop_reading();
+        return;
+    }
+    buf_len += len;
+    if (buf_len - buf_start >= ARGS_HIGH_WATER) {
+        stop_reading();
+    }
+}
+
+// Handles the input becoming readable.
+void
+args_event(void) {
+    fill();
+}
+
+// Counts up to max whole lines waiting in the buffer, and at the end
+// of input, an unfinished last line.
+static int
+count_lines(int max) {
+    int n = 0;
+
+    for (size_t pos = buf_start; pos < buf_len && n < max; n++) {
+        char *nl = memchr(buf + pos, '\n', buf_len - pos);
+        if (nl == NULL) {
+            return (at_eof) ? n + 1 : n;
+        }
+        pos = nl + 1 - buf;
+    }
+    return n;
+}
+
+// Takes the arguments for the next invocation, which are the next max
+// lines of input, or what is left of it at the end, for args_apply()
+// or args_request() to use.  Returns how many there are, 0 if they
+// haven't all arrived yet, or -1 when the input is used up.
+int
+args_take(int max) {
+    int n;
+
+    while ((n = count_lines(max)) < max && !at_eof) {
+        if (!from_file) {
+            if (!in_loop && buf_len - buf_start < ARGS_HIGH_WATER) {
+                in_loop = ev_add(args_fd, args_tag);
+            }
+            return 0;
+        }
+        fill();
+    }
+    if (n == 0) {
+        return -1;
+    }
+    if (n > taken_size) {
+        char **grown = realloc(taken, n * sizeof(char *));
+        if (grown != NULL) {
+            taken = grown;
+        }
+        size_t *grown_len = realloc(taken_len, n * sizeof(size_t));
+        if (grown_len != NULL) {
+            taken_len = grown_len;
+        }
+        if (grown == NULL || grown_len == NULL) {
+            return 0;
+        }
+        taken_size = n;
+    }
+    // The buffer is only moved by fill(), which isn't called again
+    // until these have been used.
+    if (buf_len == buf_size) {
+        char *grown = realloc(buf, buf_size + 1);
+        if (grown == NULL) {
+            return 0;
+        }
+        buf = grown;
+        buf_size++;
+    }
+    buf[buf_len] = '\0';
+    for (int i = 0; i < n; i++) {
+        char *line = buf + buf_start;
+        char *nl = strchr(line, '\n');
+        if (nl != NULL) {
+            *nl = '\0';
+            buf_start = nl + 1 - buf;
+        } else {
+            buf_start = buf_len;
+        }
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        taken[i] = line;
+        taken_len[i] = len;
+    }
+    if (!from_file && !in_loop && !at_eof && buf_len - buf_start < ARGS_HIGH_WATER) {
+        in_loop = ev_add(args_fd, args_tag);
+    }
+    return n;
+}
+
+// Prepares to build argument vectors from a template, in which each
+// word containing {} becomes one word per argument with the argument
+// in its place, and without any, the arguments go on the end.
+bool
+args_prepare(char *const template[]) {
+    while (template[nslots] != NULL) {
+        nslots++;
+    }
+    slots = calloc(nslots, sizeof(struct slot));
+    if (slots == NULL) {
+        return false;
+    }
+    for (int i = 0; i < nslots; i++) {
+        struct slot *s = &slots[i];
+        char *at = strstr(template[i], "{}");
+        s->word = template[i];
+        s->len = strlen(template[i]);
+        s->placed = (at != NULL);
+        if (s->placed) {
+            s->prefix = at - template[i];
+            placed_size += s->len - 2;
+            nplaced++;
+        } else {
+            fixed_size += s->len + 1;
+        }
+    }
+    return true;
+}
+
+// Makes the arena at least size bytes.
+static bool
+reserve(size_t size) {
+    if (size <= arena_size) {
+        return true;
+    }
+    size_t grown_size = (arena_size > 0) ? arena_size : 4096;
+    while (grown_size < size) {
+        grown_size *= 2;
+    }
+    char *grown = realloc(arena, grown_size);
+    if (grown == NULL) {
+        return false;
+    }
+    arena = grown;
+    arena_size = grown_size;
+    return true;
+}
+
+// Builds the argument vector for an invocation from the prepared
+// template and the n arguments last taken.  It's valid until the next
+// call.
+char **
+args_apply(int n) {
+    size_t words_size = 0;
+
+    for (int j = 0; j < n; j++) {
+        words_size += taken_len[j] + 1;
+    }
+    int per_word = (nplaced > 0) ? nplaced : 1;
+    size_t count = (nslots - nplaced) + (size_t)per_word * n + 1;
+    size_t size = fixed_size + n * placed_size + per_word * words_size;
+    if (!reserve(count * sizeof(char *) + size)) {
+        return NULL;
+    }
+
+    char **argv = (char **)arena;
+    char *p = arena + count * sizeof(char *);
+    int k = 0;
+    for (int i = 0; i < nslots; i++) {
+        const struct slot *s = &slots[i];
+        if (!s->placed) {
+            argv[k++] = memcpy(p, s->word, s->len + 1);
+            p += s->len + 1;
+            continue;
+        }
+        size_t suffix = s->len - s->prefix - 2;
+        for (int j = 0; j < n; j++) {
+            argv[k++] = p;
+            memcpy(p, s->word, s->prefix);
+            p += s->prefix;
+            memcpy(p, taken[j], taken_len[j]);
+            p += taken_len[j];
+            memcpy(p, s->word + s->prefix + 2, suffix + 1);
+            p += suffix + 1;
+        }
+    }
+    for (int j = 0; nplaced == 0 && j < n; j++) {
+        argv[k++] = memcpy(p, taken[j], taken_len[j] + 1);
+        p += taken_len[j] + 1;
+    }
+    argv[k] = NULL;
+    return argv;
+}
+
+// Builds the request that gives the coprocess shell the n arguments
+// last taken, valid until the next call.
+const char *
+args_request(int n) {
+    if (!reserve(shell_quoted_len(taken, n) + 2)) {
+        return NULL;
+    }
+    char *end = shell_quote_to(arena, taken, n);
+    end[0] = '\n';
+    end[1] = '\0';
+    return arena;
+}
+
+// Whether a shell command refers to its positional parameters.
+static bool
+uses_parameters(const char *command) {
+    for (const char *p = command; (p = strchr(p, '$')) != NULL; p++) {
+        const char *name = (p[1] == '{') ? p + 2 : p + 1;
+        if (*name == '@' || *name == '*' || (*name >= '1' && *name <= '9')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rewrites a shell command to take its arguments as the positional
+// parameters, which the coprocess sets for each invocation: each {}
+// becomes "$@", or without any, "$@" goes on the end unless the
+// command already uses them.
+char *
+args_command(const char *command) {
+    size_t count = 0;
+
+    for (const char *p = command; (p = strstr(p, "{}")) != NULL; p += 2) {
+        count++;
+    }
+    char *result = malloc(strlen(command) + ((count > 0) ? count * 2 : 5) + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+    if (count == 0) {
+        strcpy(result, command);
+        if (!uses_parameters(command)) {
+            strcat(result, " \"$@\"");
+        }
+        return result;
+    }
+    char *q = result;
+    for (const char *p = command; *p != '\0'; ) {
+        if (strncmp(p, "{}", 2) == 0) {
+            memcpy(q, "\"$@\"", 4);
+            q += 4;
+            p += 2;
+        } else {
+            *q++ = *p++;
+        }
+    }
+    *q = '\0';
+    return result;
+}
@@ -0,0 +1,14 @@
+#ifndef REPEAT_ARGS_H
+#define REPEAT_ARGS_H
+
+#include <stdbool.h>
+
+bool args_open(const char *path, int kind);
+void args_event(void);
+int args_take(int max);
+bool args_prepare(char *const template[]);
+char **args_apply(int n);
+const char *args_request(int n);
+char *args_command(const char *command);
+
+#endif
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Measures how much each launch path in repeat costs per invocation,
+# by running /bin/true through it a fixed number of times, and then how
+# many system calls the event loop makes per invocation, which shows
+# what a build with --enable-io-uring saves over epoll when run against
+# each build.
+#
+# Usage: bench.sh [path/to/repeat]
+#
+# BENCH_COUNT sets the number of invocations per case (default 2000).
+
+REPEAT=${1:-./repeat}
+COUNT=${BENCH_COUNT:-2000}
+
+field() {
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+run_case() {
+    name=$1
+    shift
+    json=$("$REPEAT" --stats=json -t "$COUNT" "$@" 2>&1 >/dev/null | tail -n 1)
+    runs=$(echo "$json" | field runs)
+    rate=$(echo "$json" | field runs_per_s)
+    user=$(echo "$json" | field self_user_cpu_s)
+    sys=$(echo "$json" | field self_system_cpu_s)
+    late50=$(echo "$json" | field lateness_p50_ns)
+    late99=$(echo "$json" | field lateness_p99_ns)
+    if [ -z "$runs" ] || [ "$runs" -eq 0 ]; then
+        printf '%-24s failed: %s\n' "$name" "$json"
+        return
+    fi
+    cpu=$(echo "$user $sys $runs" | awk '{ printf "%.1f", ($1 + $2) * 1e6 / $3 }')
+    if [ "$late50" = 0 ] && [ "$late99" = 0 ]; then
+        jitter="-"
+    else
+        jitter=$(echo "$late50 $late99" | awk '{ printf "%.1f/%.1f", $1 / 1e3, $2 / 1e3 }')
+    fi
+    printf '%-24s %12s %16s %18s\n' "$name" "$rate" "$cpu" "$jitter"
+}
+
+loop_case() {
+    name=$1
+    shift
+    line=$("$REPEAT" -d -t "$COUNT" "$@" 2>/dev/null | grep ' system calls ')
+    backend=${line%% *}
+    per_run=$(echo "$line" | sed -n 's/.*(\([0-9.]*\) per invocation)/\1/p')
+    if [ -z "$per_run" ]; then
+        printf '%-24s failed\n' "$name"
+        return
+    fi
+    printf '%-24s %12s %16s\n' "$name" "$backend" "$per_run"
+}
+
+printf '%-24s %12s %16s %18s\n' "case" "runs/s" "parent us/run" "late p50/p99 us"
+# A new sh -c for every run, the way system() or repeat before the
+# coprocess shell ran any command, as the baseline for the rest
+run_case "sh -c per run"         -x sh -c '/bin/true;'
+run_case "shell (coprocess)"     '/bin/true;'
+run_case "shell (direct)"        /bin/true
+run_case "fork+execvp"           --launcher=fork -x /bin/true
+run_case "posix_spawn"           --launcher=spawn -x /bin/true
+run_case "zygote (sh fork)"      --zygote sh -c 'while read -r _ <&3; do (exec 3<&- 4>&-); echo $? >&4; done'
+run_case "posix_spawn -j 4"      --launcher=spawn -j 4 -x /bin/true
+run_case "posix_spawn -j 16"     --launcher=spawn -j 16 -x /bin/true
+run_case "precise -i 1ms"        -p -i 1ms -x /bin/true
+run_case "precise -i 1ms prefork" -p -i 1ms --prefork -x /bin/true
+
+printf '\n%-24s %12s %16s\n' "case" "event loop" "syscalls/run"
+loop_case "posix_spawn"           --launcher=spawn -x /bin/true
+loop_case "posix_spawn -j 8"      --launcher=spawn -j 8 -x /bin/true
+loop_case "shell (coprocess)"     '/bin/true;'
+loop_case "precise -i 1ms"        -p -i 1ms -x /bin/true
+loop_case "timeout -T 5"          -T 5 -x /bin/true
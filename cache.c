@@ -0,0 +1,93 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "hash.h"
+
+// With --cache, a command whose declared inputs look the same as when
+// it last ran is taken to give the same result, so the result is used
+// again without running it.  The inputs are compared by what stat()
+// says about them, which costs far less than starting a process.
+static const char **paths = NULL;
+static int npaths = 0;
+static bool have_result = false;
+static uint64_t result_fingerprint;
+static int result_status;
+
+// What a fingerprint covers for each path.  A file which is rewritten
+// within the resolution of its timestamps, keeping its size, isn't
+// noticed.
+struct file_state {
+    int error;              // errno from stat(), or 0
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+// Adds a path to the inputs the cache depends on.
+bool
+cache_add(const char *path) {
+    const char **p = realloc(paths, (npaths + 1) * sizeof(*p));
+
+    if (p == NULL) {
+        return false;
+    }
+    paths = p;
+    paths[npaths++] = path;
+    return true;
+}
+
+// Returns a hash of the current state of every input.  A path which
+// doesn't exist is part of the state too, so a command testing for a
+// file to appear is cached until it does.
+uint64_t
+cache_fingerprint(void) {
+    struct xxh64 hash;
+    struct file_state fs;
+    struct stat st;
+
+    xxh64_init(&hash, 0);
+    for (int i = 0; i < npaths; i++) {
+        // Cleared so that padding hashes the same every time
+        memset(&fs, 0, sizeof(fs));
+        if (stat(paths[i], &st) < 0) {
+            fs.error = errno;
+        } else {
+            fs.dev = st.st_dev;
+            fs.ino = st.st_ino;
+            fs.mode = st.st_mode;
+            fs.size = st.st_size;
+            fs.mtime = st.st_mtim;
+            fs.ctime = st.st_ctim;
+        }
+        xxh64_update(&hash, &fs, sizeof(fs));
+    }
+    return xxh64_digest(&hash);
+}
+
+// Remembers the wait() status of a run which started with the inputs
+// in the given state.
+void
+cache_store(uint64_t fingerprint, int status) {
+    have_result = true;
+    result_fingerprint = fingerprint;
+    result_status = status;
+}
+
+// Looks up the status of the last run, if the inputs are in the same
+// state as when it started.
+bool
+cache_lookup(uint64_t fingerprint, int *status) {
+    if (!have_result || fingerprint != result_fingerprint) {
+        return false;
+    }
+    *status = result_status;
+    return true;
+}
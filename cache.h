@@ -0,0 +1,12 @@
+#ifndef REPEAT_CACHE_H
+#define REPEAT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool cache_add(const char *path);
+uint64_t cache_fingerprint(void);
+void cache_store(uint64_t fingerprint, int status);
+bool cache_lookup(uint64_t fingerprint, int *status);
+
+#endif
@@ -0,0 +1,175 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cgroup.h"
+
+// cpu.max is given as a quota of this many microseconds of CPU time
+#define CPU_PERIOD_US 100000
+
+static const char *cg_parent = NULL;
+static uint64_t cg_memory_max = 0;      // 0 for no limit
+static double cg_cpu_max = 0;           // in CPUs, 0 for no limit
+
+static bool
+write_file(int dir_fd, const char *name, const char *value) {
+    int fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t len = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return len == (ssize_t)strlen(value);
+}
+
+// Reads a number from a cgroup file: the whole file, or with key, the
+// value on the line beginning with it.  Returns -1 if it can't.
+static int64_t
+read_value(int fd, const char *key) {
+    char buf[1024];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    char *p = buf;
+    if (key != NULL) {
+        size_t keylen = strlen(key);
+        while (strncmp(p, key, keylen) != 0 || p[keylen] != ' ') {
+            p = strchr(p, '\n');
+            if (p == NULL) {
+                return -1;
+            }
+            p++;
+        }
+        p += keylen + 1;
+    }
+    char *endp;
+    long long value = strtoll(p, &endp, 10);
+    return (endp == p) ? -1 : value;
+}
+
+// Prepares to create leaves under parent, which must be a cgroup v2
+// directory with no processes of its own, by enabling the controllers
+// the limits need for its children.  Without limits, whatever
+// accounting is already enabled is used.
+bool
+cgroup_init(const char *parent, uint64_t memory_max, double cpu_max) {
+    int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = true;
+
+    if (fd < 0) {
+        return false;
+    }
+    cg_parent = parent;
+    cg_memory_max = memory_max;
+    cg_cpu_max = cpu_max;
+    if (!write_file(fd, "cgroup.subtree_control", "+memory") && memory_max > 0) {
+        ok = false;
+    }
+    if (ok && !write_file(fd, "cgroup.subtree_control", "+cpu") && cpu_max > 0) {
+        ok = false;
+    }
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ok;
+}
+
+// Creates the leaf for slot idx and applies the limits to it.
+bool
+cgroup_leaf_create(struct cgroup_leaf *leaf, int idx) {
+    char value[64];
+
+    leaf->dir_fd = leaf->peak_fd = leaf->stat_fd = -1;
+    if (asprintf(&leaf->path, "%s/repeat.%d.%d", cg_parent, (int)getpid(), idx) < 0) {
+        leaf->path = NULL;
+        return false;
+    }
+    if (mkdir(leaf->path, 0755) < 0 && errno != EEXIST) {
+        goto fail;
+    }
+    leaf->dir_fd = open(leaf->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (leaf->dir_fd < 0) {
+        goto fail;
+    }
+    if (cg_memory_max > 0) {
+        snprintf(value, sizeof(value), "%" PRIu64 "\n", cg_memory_max);
+        if (!write_file(leaf->dir_fd, "memory.max", value)) {
+            goto fail;
+        }
+    }
+    if (cg_cpu_max > 0) {
+        long long quota = cg_cpu_max * CPU_PERIOD_US;
+        snprintf(value, sizeof(value), "%lld %d\n", (quota < 1000) ? 1000 : quota,
+                 CPU_PERIOD_US);
+        if (!write_file(leaf->dir_fd, "cpu.max", value)) {
+            goto fail;
+        }
+    }
+    // Since Linux 6.12, writing to memory.peak restarts the peak seen
+    // through that descriptor, which gives a peak for each invocation.
+    leaf->peak_fd = openat(leaf->dir_fd, "memory.peak", O_RDWR | O_CLOEXEC);
+    leaf->peak_resets = leaf->peak_fd >= 0;
+    leaf->stat_fd = openat(leaf->dir_fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+    return true;
+
+fail:;
+    int saved = errno;
+    cgroup_leaf_remove(leaf);
+    errno = saved;
+    return false;
+}
+
+// Notes where the counters stand before an invocation starts.
+void
+cgroup_leaf_begin(struct cgroup_leaf *leaf) {
+    if (leaf->peak_resets && write(leaf->peak_fd, "reset\n", 6) < 0) {
+        leaf->peak_resets = false;
+    }
+    leaf->cpu_base = (leaf->stat_fd >= 0) ? read_value(leaf->stat_fd, "usage_usec") : 0;
+}
+
+// Reads the peak memory in bytes and the CPU time in microseconds of
+// the invocation since cgroup_leaf_begin(), each -1 if unknown.
+void
+cgroup_leaf_end(struct cgroup_leaf *leaf, int64_t *peak, int64_t *cpu_us) {
+    *peak = (leaf->peak_resets) ? read_value(leaf->peak_fd, NULL) : -1;
+    *cpu_us = -1;
+    if (leaf->stat_fd >= 0) {
+        int64_t usage = read_value(leaf->stat_fd, "usage_usec");
+        if (usage >= 0) {
+            *cpu_us = usage - leaf->cpu_base;
+        }
+    }
+}
+
+// Removes a leaf, which only works once everything in it has exited.
+void
+cgroup_leaf_remove(struct cgroup_leaf *leaf) {
+    if (leaf->peak_fd >= 0) {
+        close(leaf->peak_fd);
+    }
+    if (leaf->stat_fd >= 0) {
+        close(leaf->stat_fd);
+    }
+    if (leaf->dir_fd >= 0) {
+        close(leaf->dir_fd);
+    }
+    leaf->dir_fd = leaf->peak_fd = leaf->stat_fd = -1;
+    if (leaf->path != NULL) {
+        rmdir(leaf->path);
+        free(leaf->path);
+        leaf->path = NULL;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef REPEAT_CGROUP_H
+#define REPEAT_CGROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A cgroup v2 leaf which one slot's invocations run in, so that each
+// can be limited and its resource use read back when it finishes.
+struct cgroup_leaf {
+    char *path;             // NULL until created
+    int dir_fd;             // for CLONE_INTO_CGROUP
+    int peak_fd;            // memory.peak, or -1 without the memory controller
+    bool peak_resets;       // peak_fd can be reset for each invocation
+    int stat_fd;            // cpu.stat
+    int64_t cpu_base;       // usage_usec when the invocation started
+};
+
+bool cgroup_init(const char *parent, uint64_t memory_max, double cpu_max);
+bool cgroup_leaf_create(struct cgroup_leaf *leaf, int idx);
+void cgroup_leaf_begin(struct cgroup_leaf *leaf);
+void cgroup_leaf_end(struct cgroup_leaf *leaf, int64_t *peak, int64_t *cpu_us);
+void cgroup_leaf_remove(struct cgroup_leaf *leaf);
+
+#endif
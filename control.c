@@ -0,0 +1,196 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "evloop.h"
+
+// The control socket and its clients are served from the main loop
+// like any other descriptor.  Requests are lines of text, and replies
+// are small enough to go out in one write to the socket buffer, so a
+// client which doesn't read them is dropped rather than waited for.
+#define CONTROL_MAX_CLIENTS 16
+
+struct client {
+    int fd;                 // -1 when unused
+    size_t len;
+    char buf[1024];
+};
+
+static const char *socket_path = NULL;
+static int listen_fd = -1;
+static int tag_kind;
+static control_handler *handle_line;
+static struct client clients[CONTROL_MAX_CLIENTS];
+
+// Listens on a Unix socket at path, replacing a stale socket left
+// there.  Events come tagged with kind, index 0 for the listening
+// socket and one more than the client's number for clients.
+bool
+control_open(const char *path, int kind, control_handler *handler) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        return false;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, CONTROL_MAX_CLIENTS) < 0 ||
+        !ev_add(listen_fd, EV_TAG(kind, 0))) {
+        int saved = errno;
+        close(listen_fd);
+        listen_fd = -1;
+        errno = saved;
+        return false;
+    }
+    socket_path = path;
+    tag_kind = kind;
+    handle_line = handler;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    return true;
+}
+
+static void
+drop_client(struct client *c) {
+    ev_del(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Sends a whole reply, or drops the client if it won't fit.
+static bool
+send_reply(struct client *c, const char *buf, size_t len) {
+    if (len > 0 && send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len) {
+        drop_client(c);
+        return false;
+    }
+    return true;
+}
+
+// Answers one line from a client.  A line starting with "GET " is
+// taken to be an HTTP request, such as a Prometheus scrape, and is
+// answered with the metrics and the connection closed.
+static void
+answer(struct client *c, char *line) {
+    char metrics[] = "metrics";
+    char *body = NULL, *head = NULL;
+    size_t body_len = 0, head_len = 0;
+    bool http = strncmp(line, "GET ", 4) == 0;
+
+    FILE *reply = open_memstream(&body, &body_len);
+    if (reply == NULL) {
+        drop_client(c);
+        return;
+    }
+    handle_line((http) ? metrics : line, reply);
+    fclose(reply);
+    if (http) {
+        FILE *h = open_memstream(&head, &head_len);
+        if (h != NULL) {
+            fprintf(h, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\n\r\n", body_len);
+            fclose(h);
+            if (send_reply(c, head, head_len) && send_reply(c, body, body_len)) {
+                drop_client(c);
+            }
+        } else {
+            drop_client(c);
+        }
+    } else {
+        send_reply(c, body, body_len);
+    }
+    free(head);
+    free(body);
+}
+
+static void
+accept_clients(void) {
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int i = 0;
+        while (i < CONTROL_MAX_CLIENTS && clients[i].fd >= 0) {
+            i++;
+        }
+        if (i == CONTROL_MAX_CLIENTS || !ev_add(fd, EV_TAG(tag_kind, i + 1))) {
+            close(fd);
+            continue;
+        }
+        clients[i].fd = fd;
+        clients[i].len = 0;
+    }
+}
+
+static void
+read_client(struct client *c) {
+    ssize_t len = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0) {
+        drop_client(c);
+        return;
+    }
+    c->len += len;
+    c->buf[c->len] = '\0';
+    char *line = c->buf, *nl;
+    while (c->fd >= 0 && (nl = strchr(line, '\n')) != NULL) {
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r') {
+            nl[-1] = '\0';
+        }
+        answer(c, line);
+        line = nl + 1;
+    }
+    if (c->fd < 0) {
+        return;
+    }
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    // A line too long for the buffer isn't a request we understand
+    if (c->len == sizeof(c->buf) - 1) {
+        drop_client(c);
+    }
+}
+
+// Handles readiness of the descriptor with the given index.
+void
+control_event(int idx) {
+    if (idx == 0) {
+        accept_clients();
+    } else if (clients[idx - 1].fd >= 0) {
+        read_client(&clients[idx - 1]);
+    }
+}
+
+void
+control_close(void) {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path);
+        listen_fd = -1;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef REPEAT_CONTROL_H
+#define REPEAT_CONTROL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Called with each line a client sends, without its newline, and a
+// stream to write the reply to.
+typedef void control_handler(char *line, FILE *reply);
+
+bool control_open(const char *path, int kind, control_handler *handler);
+void control_event(int idx);
+void control_close(void);
+
+#endif
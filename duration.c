@@ -0,0 +1,99 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "duration.h"
+
+static const struct {
+    const char *name;
+    int64_t ns;
+} UNITS[] = {
+    { "ns", 1 },
+    { "us", 1000 },
+    { "ms", 1000000 },
+    { "s", NS_IN_SEC },
+    { "m", 60 * NS_IN_SEC },
+    { "h", 3600 * NS_IN_SEC },
+    { "d", 86400 * NS_IN_SEC },
+};
+
+// Parses a duration such as "1.5", "250ms" or "1h30m" without going
+// through floating point, so every value is exact to the nanosecond.
+// A number without a unit is in seconds, but only when it stands
+// alone.  Returns false if the string isn't a duration or the total
+// doesn't fit in an int64_t of nanoseconds.
+bool
+parse_duration(const char *str, struct timespec *result) {
+    int64_t total = 0;
+    const char *p = str;
+    bool single = true;
+
+    if (*p == '\0') {
+        return false;
+    }
+    while (*p != '\0') {
+        const char *int_start = p, *frac_start = NULL, *frac_end = NULL;
+        int64_t unit_ns = 0;
+        size_t unit_len = 0;
+
+        while (isdigit((unsigned char)*p)) {
+            p++;
+        }
+        const char *int_end = p;
+        if (*p == '.') {
+            frac_start = ++p;
+            while (isdigit((unsigned char)*p)) {
+                p++;
+            }
+            frac_end = p;
+        }
+        if (int_end == int_start && frac_end == frac_start) {
+            return false;
+        }
+
+        // Take the longest unit name that matches, so "ms" wins over "m"
+        for (size_t i = 0; i < sizeof(UNITS) / sizeof(UNITS[0]); i++) {
+            size_t len = strlen(UNITS[i].name);
+            if (len > unit_len && strncmp(p, UNITS[i].name, len) == 0) {
+                unit_ns = UNITS[i].ns;
+                unit_len = len;
+            }
+        }
+        if (unit_len == 0) {
+            if (*p != '\0' || !single) {
+                return false;
+            }
+            unit_ns = NS_IN_SEC;
+        }
+        p += unit_len;
+        if (*p != '\0') {
+            single = false;
+        }
+
+        int64_t value = 0;
+        for (const char *d = int_start; d < int_end; d++) {
+            if (__builtin_mul_overflow(value, 10, &value) ||
+                __builtin_add_overflow(value, *d - '0', &value)) {
+                return false;
+            }
+        }
+        if (__builtin_mul_overflow(value, unit_ns, &value)) {
+            return false;
+        }
+        // Every unit is a multiple of a power of ten nanoseconds, so
+        // dividing it down digit by digit stays exact until it drops
+        // below a nanosecond, and anything finer is truncated.
+        int64_t scale = unit_ns;
+        for (const char *d = frac_start; d != NULL && d < frac_end && scale >= 10; d++) {
+            scale /= 10;
+            value += (*d - '0') * scale;
+        }
+        if (__builtin_add_overflow(total, value, &total)) {
+            return false;
+        }
+    }
+
+    *result = timespec_from_ns(total);
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef REPEAT_DURATION_H
+#define REPEAT_DURATION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NS_IN_SEC 1000000000L
+#define TIME_T_MAX ((time_t)INT64_MAX)
+
+bool parse_duration(const char *str, struct timespec *result);
+
+// Adds two normalized timespecs, saturating at the largest
+// representable time instead of wrapping around.
+static inline struct timespec
+timespec_add(const struct timespec *a, const struct timespec *b) {
+    struct timespec result;
+    long nsecs = a->tv_nsec + b->tv_nsec;
+    time_t carry = (nsecs >= NS_IN_SEC) ? 1 : 0;
+
+    if (__builtin_add_overflow(a->tv_sec, b->tv_sec, &result.tv_sec) ||
+        __builtin_add_overflow(result.tv_sec, carry, &result.tv_sec)) {
+        result.tv_sec = TIME_T_MAX;
+        result.tv_nsec = NS_IN_SEC - 1;
+        return result;
+    }
+    result.tv_nsec = nsecs - carry * NS_IN_SEC;
+    return result;
+}
+
+// Returns the difference a - b.  Both must be normalized.
+static inline struct timespec
+timespec_sub(const struct timespec *a, const struct timespec *b) {
+    struct timespec result = { a->tv_sec - b->tv_sec, a->tv_nsec - b->tv_nsec };
+
+    if (result.tv_nsec < 0) {
+        result.tv_sec--;
+        result.tv_nsec += NS_IN_SEC;
+    }
+    return result;
+}
+
+static inline int
+timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) {
+        return (a->tv_sec < b->tv_sec) ? -1 : 1;
+    }
+    if (a->tv_nsec != b->tv_nsec) {
+        return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Converts to nanoseconds, saturating at INT64_MIN/INT64_MAX, which
+// is about 292 years either side of zero.
+static inline int64_t
+timespec_to_ns(const struct timespec *ts) {
+    int64_t ns;
+
+    if (__builtin_mul_overflow((int64_t)ts->tv_sec, NS_IN_SEC, &ns) ||
+        __builtin_add_overflow(ns, ts->tv_nsec, &ns)) {
+        return (ts->tv_sec < 0) ? INT64_MIN : INT64_MAX;
+    }
+    return ns;
+}
+
+static inline struct timespec
+timespec_from_ns(int64_t ns) {
+    struct timespec result = { ns / NS_IN_SEC, ns % NS_IN_SEC };
+
+    if (result.tv_nsec < 0) {
+        result.tv_sec--;
+        result.tv_nsec += NS_IN_SEC;
+    }
+    return result;
+}
+
+#endif
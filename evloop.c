@@ -0,0 +1,339 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+// System calls made to manage and wait on the epoll set and timer
+static uint64_t epoll_calls = 0;
+
+#ifdef USE_IO_URING
+#include <poll.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+// With io_uring, each descriptor is waited on with a one-shot poll,
+// armed again after its event has been handled, and the schedule with
+// an absolute timeout instead of a timerfd.  Everything that changed
+// since the last wait is submitted in the same system call as the next
+// one.  A multishot poll would save re-arming, but only reports new
+// data, where callers expect epoll's level triggering.
+//
+// Polls are identified by descriptor and a generation, bumped each
+// time the descriptor is removed, so that a completion left over from
+// an earlier use of it is recognised and dropped.
+struct watch {
+    uint64_t tag;
+    uint32_t gen;
+    bool active;
+    bool armed;
+};
+
+#define UD_TIMER (1ULL << 63)
+#define UD_IGNORE (~0ULL)
+#define UD_POLL(fd, gen) (((uint64_t)((gen) & 0x7fffffff) << 32) | (uint32_t)(fd))
+
+static bool use_uring = false;
+static struct watch *watches = NULL;   // indexed by descriptor
+static int nwatches = 0;
+static int *rearm = NULL;              // descriptors to poll again before waiting
+static int nrearm = 0;
+static bool timer_armed = false;
+static uint32_t timer_gen = 0;
+static struct __kernel_timespec timer_ts;
+
+static bool
+uring_poll(int fd) {
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_POLL(fd, watches[fd].gen);
+    watches[fd].armed = true;
+    return true;
+}
+
+static bool
+uring_add(int fd, uint64_t tag) {
+    if (fd >= nwatches) {
+        int size = (fd + 64) & ~63;
+        struct watch *w = realloc(watches, size * sizeof(*w));
+        int *r = realloc(rearm, size * sizeof(*r));
+        if (w != NULL) {
+            watches = w;
+        }
+        if (r != NULL) {
+            rearm = r;
+        }
+        if (w == NULL || r == NULL) {
+            errno = ENOMEM;
+            return false;
+        }
+        memset(watches + nwatches, 0, (size - nwatches) * sizeof(*w));
+        nwatches = size;
+    }
+    if (watches[fd].active) {
+        errno = EEXIST;
+        return false;
+    }
+    watches[fd].tag = tag;
+    watches[fd].active = true;
+    return watches[fd].armed || uring_poll(fd);
+}
+
+static void
+uring_del(int fd) {
+    if (fd >= nwatches || !watches[fd].active) {
+        return;
+    }
+    watches[fd].active = false;
+    if (watches[fd].armed) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = UD_POLL(fd, watches[fd].gen);
+            sqe->user_data = UD_IGNORE;
+        }
+        watches[fd].armed = false;
+    }
+    watches[fd].gen++;
+}
+
+static bool
+uring_set_timer(const struct timespec *when) {
+    struct io_uring_sqe *sqe;
+
+    // The loop sets the timer every time round, mostly to what it was
+    if (when != NULL && timer_armed &&
+        timer_ts.tv_sec == when->tv_sec && timer_ts.tv_nsec == when->tv_nsec) {
+        return true;
+    }
+    if (timer_armed) {
+        if ((sqe = uring_sqe()) == NULL) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = UD_TIMER | timer_gen;
+        sqe->user_data = UD_IGNORE;
+        timer_armed = false;
+        timer_gen++;
+    }
+    if (when == NULL) {
+        return true;
+    }
+    if ((sqe = uring_sqe()) == NULL) {
+        return false;
+    }
+    // The kernel reads the time when the entry is submitted, and any
+    // earlier timeout still queued with it has just been removed.
+    timer_ts.tv_sec = when->tv_sec;
+    timer_ts.tv_nsec = when->tv_nsec;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&timer_ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = UD_TIMER | timer_gen;
+    timer_armed = true;
+    return true;
+}
+
+static int
+uring_wait(uint64_t *tags, int max) {
+    struct io_uring_cqe cqe;
+    int n = 0;
+
+    while (n == 0) {
+        for (int i = 0; i < nrearm; i++) {
+            int fd = rearm[i];
+            if (watches[fd].active && !watches[fd].armed && !uring_poll(fd)) {
+                return -1;
+            }
+        }
+        nrearm = 0;
+        if (uring_enter(1) < 0) {
+            return (errno == EINTR) ? 0 : -1;
+        }
+        while (n < max && uring_next(&cqe)) {
+            if (cqe.user_data == UD_IGNORE || cqe.res == -ECANCELED) {
+                continue;
+            }
+            if (cqe.user_data & UD_TIMER) {
+                if ((uint32_t)cqe.user_data == timer_gen && timer_armed) {
+                    timer_armed = false;
+                    timer_gen++;
+                    tags[n++] = EV_TAG(EV_TIMER, 0);
+                }
+                continue;
+            }
+            int fd = (uint32_t)cqe.user_data;
+            if (fd < nwatches && watches[fd].armed &&
+                cqe.user_data == UD_POLL(fd, watches[fd].gen)) {
+                watches[fd].armed = false;
+                rearm[nrearm++] = fd;
+                tags[n++] = watches[fd].tag;
+            }
+        }
+    }
+    return n;
+}
+#endif
+
+// Creates the epoll set, or with io_uring the ring, with its timer and
+// signal descriptors.  The signals must already be blocked.
+bool
+ev_init(const sigset_t *signals) {
+    signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        return false;
+    }
+#ifdef USE_IO_URING
+    // Where io_uring isn't available this falls back to epoll
+    if (uring_init(256, 4096)) {
+        use_uring = true;
+        return ev_add(signal_fd, EV_TAG(EV_SIGNAL, 0));
+    }
+#endif
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return false;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return false;
+    }
+    return ev_add(signal_fd, EV_TAG(EV_SIGNAL, 0)) && ev_add(timer_fd, EV_TAG(EV_TIMER, 0));
+}
+
+bool
+ev_add(int fd, uint64_t tag) {
+    struct epoll_event ev;
+
+#ifdef USE_IO_URING
+    if (use_uring) {
+        return uring_add(fd, tag);
+    }
+#endif
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    epoll_calls++;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void
+ev_del(int fd) {
+#ifdef USE_IO_URING
+    if (use_uring) {
+        uring_del(fd);
+        return;
+    }
+#endif
+    epoll_calls++;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Arms the timer to fire at the given CLOCK_MONOTONIC time, or
+// disarms it if when is NULL.  A time already past fires at once.
+bool
+ev_set_timer(const struct timespec *when) {
+    struct itimerspec spec;
+
+#ifdef USE_IO_URING
+    if (use_uring) {
+        return uring_set_timer(when);
+    }
+#endif
+    memset(&spec, 0, sizeof(spec));
+    if (when != NULL) {
+        spec.it_value = *when;
+        // An all-zero it_value would disarm the timer instead
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    epoll_calls++;
+    return timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+// Waits until at least one source is ready and stores up to max of
+// their tags.  Returns the number stored, 0 if interrupted, or -1 on
+// error.
+int
+ev_wait(uint64_t *tags, int max) {
+    struct epoll_event events[64];
+
+#ifdef USE_IO_URING
+    if (use_uring) {
+        return uring_wait(tags, max);
+    }
+#endif
+    if (max > 64) {
+        max = 64;
+    }
+    epoll_calls++;
+    int n = epoll_wait(epoll_fd, events, max, -1);
+    if (n < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        tags[i] = events[i].data.u64;
+        if (EV_KIND(tags[i]) == EV_TIMER) {
+            // This only clears the timer; the caller works out what
+            // is due.
+            uint64_t expirations;
+            epoll_calls++;
+            ssize_t len = read(timer_fd, &expirations, sizeof(expirations));
+            (void)len;
+        }
+    }
+    return n;
+}
+
+// Returns the next pending signal, or 0 when there are none left.
+int
+ev_next_signal(void) {
+    struct signalfd_siginfo info;
+
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return 0;
+    }
+    return info.ssi_signo;
+}
+
+// Names what the loop waits with, for -d.
+const char *
+ev_backend_name(void) {
+#ifdef USE_IO_URING
+    if (use_uring) {
+        return "io_uring";
+    }
+#endif
+    return "epoll";
+}
+
+// Returns how many system calls the loop has made to wait, including
+// those to add and remove descriptors and set the timer, but not to
+// read signals, which each backend does the same way.
+uint64_t
+ev_syscalls(void) {
+#ifdef USE_IO_URING
+    if (use_uring) {
+        return uring_enter_count();
+    }
+#endif
+    return epoll_calls;
+}
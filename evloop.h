@@ -0,0 +1,32 @@
+#ifndef REPEAT_EVLOOP_H
+#define REPEAT_EVLOOP_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Everything the main loop waits for is a descriptor in one epoll set,
+// or an io_uring where built with it: a timer for the schedule, a
+// signalfd for signals, and whatever the caller adds, each identified
+// by a tag of a kind and an index.
+#define EV_TAG(kind, idx) (((uint64_t)(kind) << 32) | (uint32_t)(idx))
+#define EV_KIND(tag) ((int)((tag) >> 32))
+#define EV_INDEX(tag) ((int)(uint32_t)(tag))
+
+enum {
+    EV_TIMER,       // the time given to ev_set_timer() has passed
+    EV_SIGNAL,      // read the signals with ev_next_signal()
+    EV_USER,        // first kind available to callers
+};
+
+bool ev_init(const sigset_t *signals);
+bool ev_add(int fd, uint64_t tag);
+void ev_del(int fd);
+bool ev_set_timer(const struct timespec *when);
+int ev_wait(uint64_t *tags, int max);
+int ev_next_signal(void);
+const char *ev_backend_name(void);
+uint64_t ev_syscalls(void);
+
+#endif
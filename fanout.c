@@ -0,0 +1,232 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "evloop.h"
+#include "fanout.h"
+#include "launch.h"
+#include "shell.h"
+
+// A coordinator runs one worker per host, each over a single ssh
+// session for as long as it runs.  Workers send back a JSON line for
+// every invocation on stdout, and stop when their stdin is closed.
+struct host {
+    char *name;
+    pid_t pid;
+    int in_fd;              // the worker's stdin, or -1 once closed
+    int out_fd;             // the worker's records, or -1 at the end
+    size_t start;           // of the first line not yet returned
+    size_t len;
+    char buf[8192];
+};
+
+static struct host *hosts = NULL;
+static int nhosts = 0;
+
+// Options given to ssh before the host.  Connections are shared with
+// any other ssh to the same host through a control socket, and kept
+// open for a minute after, so that running repeat again doesn't have
+// to log in again.
+static char *const ssh_options[] = {
+    "-T",
+    "-o", "BatchMode=yes",
+    "-o", "ControlMaster=auto",
+    "-o", "ControlPath=~/.ssh/repeat-%C",
+    "-o", "ControlPersist=60",
+};
+#define SSH_OPTIONS (sizeof(ssh_options) / sizeof(ssh_options[0]))
+
+// Reads the hosts to run on from path, one to a line.  Blank lines
+// and lines starting with # are ignored.
+bool
+fanout_load(const char *path) {
+    FILE *f = fopen(path, "re");
+    char *line = NULL;
+    size_t size = 0;
+
+    if (f == NULL) {
+        return false;
+    }
+    while (getline(&line, &size, f) >= 0) {
+        char *name = line + strspn(line, " \t");
+        name[strcspn(name, " \t\r\n")] = '\0';
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+        struct host *h = realloc(hosts, (nhosts + 1) * sizeof(*h));
+        if (h == NULL || (name = strdup(name)) == NULL) {
+            free(line);
+            fclose(f);
+            errno = ENOMEM;
+            return false;
+        }
+        hosts = h;
+        memset(&hosts[nhosts], 0, sizeof(hosts[nhosts]));
+        hosts[nhosts].name = name;
+        hosts[nhosts].in_fd = hosts[nhosts].out_fd = -1;
+        nhosts++;
+    }
+    free(line);
+    fclose(f);
+    return true;
+}
+
+int
+fanout_count(void) {
+    return nhosts;
+}
+
+const char *
+fanout_name(int idx) {
+    return hosts[idx].name;
+}
+
+static bool
+start_host(struct host *h, char *const ssh_argv[], const char *command, uint64_t tag) {
+    int in_pipe[2], out_pipe[2];
+    int nssh = 0;
+
+    while (ssh_argv[nssh] != NULL) {
+        nssh++;
+    }
+    char **argv = calloc(nssh + SSH_OPTIONS + 3, sizeof(char *));
+    if (argv == NULL) {
+        return false;
+    }
+    memcpy(argv, ssh_argv, nssh * sizeof(char *));
+    memcpy(argv + nssh, ssh_options, sizeof(ssh_options));
+    argv[nssh + SSH_OPTIONS] = h->name;
+    argv[nssh + SSH_OPTIONS + 1] = (char *)command;
+
+    if (pipe2(in_pipe, O_CLOEXEC) < 0) {
+        free(argv);
+        return false;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        free(argv);
+        return false;
+    }
+    struct launch_dup dups[] = { { in_pipe[0], 0 }, { out_pipe[1], 1 } };
+    h->pid = launch_command(argv[0], argv, dups, 2);
+    int saved = errno;
+    free(argv);
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    h->in_fd = in_pipe[1];
+    h->out_fd = out_pipe[0];
+    if (h->pid < 0) {
+        errno = saved;
+        return false;
+    }
+    // Only our end is non-blocking; ssh writes its end as it likes
+    fcntl(h->out_fd, F_SETFL, fcntl(h->out_fd, F_GETFL) | O_NONBLOCK);
+    return ev_add(h->out_fd, tag);
+}
+
+// Starts worker_argv on every host through ssh_argv, adding each
+// host's records to the event loop with the given kind and the host's
+// index.
+bool
+fanout_start(char *const ssh_argv[], char *const worker_argv[], int kind) {
+    int nworker = 0;
+
+    while (worker_argv[nworker] != NULL) {
+        nworker++;
+    }
+    char *command = shell_quote(worker_argv, nworker);
+
+    if (command == NULL) {
+        return false;
+    }
+    for (int i = 0; i < nhosts; i++) {
+        if (!start_host(&hosts[i], ssh_argv, command, EV_TAG(kind, i))) {
+            int saved = errno;
+            free(command);
+            errno = saved;
+            return false;
+        }
+    }
+    free(command);
+    return true;
+}
+
+// Reads what a host has sent.  Returns 1 while its worker is still
+// running, 0 when it has finished, or -1 on an error.  Either of the
+// last two is only returned once, as the connection is then closed.
+int
+fanout_read(int idx) {
+    struct host *h = &hosts[idx];
+
+    if (h->start > 0) {
+        h->len -= h->start;
+        memmove(h->buf, h->buf + h->start, h->len);
+        h->start = 0;
+    }
+    // A line longer than any record isn't one, so is thrown away
+    if (h->len == sizeof(h->buf)) {
+        h->len = 0;
+    }
+    ssize_t len = read(h->out_fd, h->buf + h->len, sizeof(h->buf) - h->len);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 1;
+    }
+    if (len <= 0) {
+        ev_del(h->out_fd);
+        close(h->out_fd);
+        h->out_fd = -1;
+        return (len == 0) ? 0 : -1;
+    }
+    h->len += len;
+    return 1;
+}
+
+// Returns the next whole line read from a host, without its newline,
+// or NULL if there isn't one yet.
+char *
+fanout_line(int idx) {
+    struct host *h = &hosts[idx];
+    char *line = h->buf + h->start;
+    char *nl = memchr(line, '\n', h->len - h->start);
+
+    if (nl == NULL) {
+        return NULL;
+    }
+    *nl = '\0';
+    h->start = nl + 1 - h->buf;
+    return line;
+}
+
+// Waits for the ssh for a finished host to exit, and returns its
+// wait() status.
+int
+fanout_wait(int idx) {
+    int status = 0;
+
+    if (hosts[idx].in_fd >= 0) {
+        close(hosts[idx].in_fd);
+        hosts[idx].in_fd = -1;
+    }
+    while (waitpid(hosts[idx].pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return status;
+}
+
+// Tells every worker to stop once its running invocations finish.
+void
+fanout_stop(void) {
+    for (int i = 0; i < nhosts; i++) {
+        if (hosts[i].in_fd >= 0) {
+            close(hosts[i].in_fd);
+            hosts[i].in_fd = -1;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef REPEAT_FANOUT_H
+#define REPEAT_FANOUT_H
+
+#include <stdbool.h>
+
+bool fanout_load(const char *path);
+int fanout_count(void);
+const char *fanout_name(int idx);
+bool fanout_start(char *const ssh_argv[], char *const worker_argv[], int kind);
+int fanout_read(int idx);
+char *fanout_line(int idx);
+int fanout_wait(int idx);
+void fanout_stop(void);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef REPEAT_HASH_H
+#define REPEAT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming state for XXH64, which hashes output in fixed memory as
+// it arrives.
+struct xxh64 {
+    uint64_t total_len;
+    uint64_t v[4];
+    unsigned char mem[32];
+    size_t memsize;
+};
+
+void xxh64_init(struct xxh64 *state, uint64_t seed);
+void xxh64_update(struct xxh64 *state, const void *data, size_t len);
+uint64_t xxh64_digest(const struct xxh64 *state);
+
+#endif
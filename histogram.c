@@ -0,0 +1,121 @@
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static inline int
+bucket_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    int shift = exp - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+static inline uint64_t
+bucket_lower_bound(int idx) {
+    if (idx < HIST_SUB_COUNT) {
+        return idx;
+    }
+    int shift = idx / HIST_SUB_COUNT - 1;
+    return (uint64_t)(idx % HIST_SUB_COUNT + HIST_SUB_COUNT) << shift;
+}
+
+void
+hist_init(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void
+hist_record(struct histogram *h, uint64_t value) {
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+// Returns the value below which the fraction q of recorded values
+// fall, to within the precision of the buckets.
+uint64_t
+hist_quantile(const struct histogram *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    uint64_t seen = 0;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_lower_bound(i);
+            if (value < h->min) {
+                return h->min;
+            }
+            return (value > h->max) ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+// Returns how many recorded values are no more than value, counting
+// the whole of the bucket it falls in.
+uint64_t
+hist_count_upto(const struct histogram *h, uint64_t value) {
+    int last = bucket_index(value);
+    uint64_t count = 0;
+
+    for (int i = 0; i <= last; i++) {
+        count += h->buckets[i];
+    }
+    return count;
+}
+
+double
+hist_mean(const struct histogram *h) {
+    return (h->count) ? (double)h->sum / h->count : 0.0;
+}
+
+// Compares the values in two histograms with the Mann-Whitney U test,
+// counting values in the same bucket as ties.  Sets *superiority to
+// the chance that a value from b is greater than one from a, with ties
+// counting half, and returns the two-sided p value for it differing
+// from a half, by the normal approximation with the tie correction.
+double
+hist_mann_whitney(const struct histogram *a, const struct histogram *b, double *superiority) {
+    double na = a->count, nb = b->count, n = na + nb;
+    double rank = 0, rank_sum = 0, ties = 0;
+
+    *superiority = 0.5;
+    if (na == 0 || nb == 0) {
+        return 1.0;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        double t = (double)a->buckets[i] + b->buckets[i];
+        if (t == 0) {
+            continue;
+        }
+        rank_sum += b->buckets[i] * (rank + (t + 1) / 2);
+        rank += t;
+        ties += t * t * t - t;
+    }
+    double u = rank_sum - nb * (nb + 1) / 2;
+    double mu = na * nb / 2;
+    double var = na * nb / 12 * ((n + 1) - ties / (n * (n - 1)));
+    *superiority = u / (na * nb);
+    if (!(var > 0)) {
+        return 1.0;
+    }
+    double z = fmax(fabs(u - mu) - 0.5, 0) / sqrt(var);
+    return erfc(z / sqrt(2));
+}
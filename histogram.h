@@ -0,0 +1,30 @@
+#ifndef REPEAT_HISTOGRAM_H
+#define REPEAT_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Values below 2^HIST_SUB_BITS are counted exactly.  Above that, each
+// power of two is split into 2^HIST_SUB_BITS linear buckets, so any
+// recorded value is within 1/128 of its bucket's lower bound while
+// covering the whole uint64_t range in a fixed amount of memory.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_quantile(const struct histogram *h, double q);
+uint64_t hist_count_upto(const struct histogram *h, uint64_t value);
+double hist_mean(const struct histogram *h);
+double hist_mann_whitney(const struct histogram *a, const struct histogram *b,
+                         double *superiority);
+
+#endif
@@ -0,0 +1,298 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWNP)
+#define USE_SPAWN 1
+#include <spawn.h>
+#endif
+
+#include "launch.h"
+
+#ifdef USE_SPAWN
+enum launch_method launch_method = LAUNCH_SPAWN;
+#else
+enum launch_method launch_method = LAUNCH_FORK;
+#endif
+
+static const char *method_names[] = {
+    [LAUNCH_FORK] = "fork",
+    [LAUNCH_SPAWN] = "spawn",
+};
+
+static sigset_t child_sigmask;
+static bool child_pgroup = false;
+static const cpu_set_t *child_cpus = NULL;
+static cpu_set_t parent_cpus;
+static int child_cgroup = -1;
+static int child_stamp = -1;
+static bool use_clone3 = true;
+
+#ifdef USE_SPAWN
+static posix_spawnattr_t spawn_attr;
+#endif
+
+bool
+launch_set_method(const char *name) {
+    for (size_t i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++) {
+        if (strcmp(name, method_names[i]) == 0) {
+#ifndef USE_SPAWN
+            if (i == LAUNCH_SPAWN) {
+                return false;
+            }
+#endif
+            launch_method = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *
+launch_method_name(void) {
+    return method_names[launch_method];
+}
+
+// Records the signal mask children should run with.  The parent
+// blocks signals it only wants to see through the event loop, so they
+// must be unblocked again in the child before the command starts.
+// With new_pgroup, each child leads a process group of its own, so
+// that it can be signalled along with anything it starts.
+void
+launch_init(const sigset_t *child_mask, bool new_pgroup) {
+    child_sigmask = *child_mask;
+    child_pgroup = new_pgroup;
+#ifdef USE_SPAWN
+    sigset_t defaults;
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&spawn_attr);
+    posix_spawnattr_setsigmask(&spawn_attr, &child_sigmask);
+    posix_spawnattr_setsigdefault(&spawn_attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (new_pgroup) {
+        posix_spawnattr_setpgroup(&spawn_attr, 0);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&spawn_attr, flags);
+#endif
+}
+
+// Sets the CPUs that children started from now on may run on, or with
+// NULL, lets them run wherever repeat itself may.
+void
+launch_set_cpus(const cpu_set_t *cpus) {
+    if (cpus != NULL && child_cpus == NULL) {
+        sched_getaffinity(0, sizeof(parent_cpus), &parent_cpus);
+    }
+    child_cpus = cpus;
+}
+
+// Has children started from now on write the CLOCK_MONOTONIC time
+// they exec the command at to fd, as a struct timespec, or with -1,
+// not.  posix_spawn only returns once the child has exec'd, so a child
+// it starts has the time written for it as it returns.
+void
+launch_set_stamp(int fd) {
+    child_stamp = fd;
+}
+
+// Puts children started from now on into the cgroup open on fd, or
+// with -1, leaves them in repeat's own.
+void
+launch_set_cgroup(int fd) {
+    child_cgroup = fd;
+}
+
+// Writes the time for launch_set_stamp().  The pipe doesn't block, and
+// a stamp that doesn't fit is only a lost measurement.
+static void
+write_stamp(void) {
+    struct timespec now;
+
+    if (child_stamp >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ssize_t len = write(child_stamp, &now, sizeof(now));
+        (void)len;
+    }
+}
+
+// Forks, straight into child_cgroup if there is one and the kernel
+// can, so that no part of the child ever runs outside it.
+static pid_t
+fork_child(void) {
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    if (child_cgroup >= 0 && use_clone3) {
+        struct clone_args args = {
+            .flags = CLONE_INTO_CGROUP,
+            .exit_signal = SIGCHLD,
+            .cgroup = child_cgroup,
+        };
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL)) {
+            return pid;
+        }
+        use_clone3 = false;
+    }
+#else
+    use_clone3 = false;
+#endif
+    return fork();
+}
+
+// Forks a child to run the command.  With a gate descriptor, the
+// child does everything but the exec, then waits to read a byte from
+// the gate first.
+static pid_t
+launch_fork(const char *file, char *const argv[],
+            const struct launch_dup *dups, int ndups, int gate) {
+    pid_t child_pid = fork_child();
+    if (child_pid == 0) {
+        // Without clone3(), join the cgroup before the command starts
+        if (child_cgroup >= 0 && !use_clone3) {
+            int fd = openat(child_cgroup, "cgroup.procs", O_WRONLY);
+            if (fd < 0 || write(fd, "0\n", 2) != 2) {
+                _exit(1);
+            }
+            close(fd);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        if (child_pgroup) {
+            setpgid(0, 0);
+        }
+        if (child_cpus != NULL) {
+            sched_setaffinity(0, sizeof(*child_cpus), child_cpus);
+        }
+        for (int i = 0; i < ndups; i++) {
+            if (dups[i].from == dups[i].to) {
+                fcntl(dups[i].to, F_SETFD, 0);
+            } else if (dup2(dups[i].from, dups[i].to) < 0) {
+                _exit(1);
+            }
+        }
+        char go;
+        if (gate >= 0 && read(gate, &go, 1) != 1) {
+            _exit(1);
+        }
+        write_stamp();
+        execvp(file, argv);
+        // Fail the way sh -c would have, had it been asked to run this
+        int err = errno;
+        fprintf(stderr, "%s: %s\n", file, strerror(err));
+        _exit((err == ENOENT) ? 127 : 126);
+    }
+    // Also set it here, so it's in place whichever of us runs first
+    if (child_pid > 0 && child_pgroup) {
+        setpgid(child_pid, child_pid);
+    }
+    return child_pid;
+}
+
+#ifdef USE_SPAWN
+static pid_t
+launch_spawn(const char *file, char *const argv[],
+             const struct launch_dup *dups, int ndups) {
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    pid_t child_pid;
+    int err;
+
+    // There's no spawn attribute for affinity, so the child inherits
+    // it from us for the moment it takes to start.
+    if (child_cpus != NULL) {
+        sched_setaffinity(0, sizeof(*child_cpus), child_cpus);
+    }
+    if (ndups == 0) {
+        err = posix_spawnp(&child_pid, file, NULL, &spawn_attr, argv, environ);
+    } else {
+        posix_spawn_file_actions_init(&actions);
+        for (int i = 0; i < ndups; i++) {
+            posix_spawn_file_actions_adddup2(&actions, dups[i].from, dups[i].to);
+        }
+        err = posix_spawnp(&child_pid, file, &actions, &spawn_attr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if (child_cpus != NULL) {
+        sched_setaffinity(0, sizeof(parent_cpus), &parent_cpus);
+    }
+    if (err == EAGAIN || err == ENOMEM) {
+        errno = err;
+        return -1;
+    }
+    if (err == 0) {
+        write_stamp();
+    }
+    if (err != 0) {
+        // The command itself couldn't be run.  That isn't repeat's
+        // failure, so leave a forked child to report it as a run which
+        // exited 127 or 126, the way the shell would.
+        return launch_fork(file, argv, dups, ndups, -1);
+    }
+    return child_pid;
+}
+#endif
+
+// Starts one invocation of the command, with the given descriptors
+// installed in the child.  Returns the child pid, or -1 with errno set
+// if the child could not be started.
+pid_t
+launch_command(const char *file, char *const argv[],
+               const struct launch_dup *dups, int ndups) {
+    // posix_spawn has no way to start a child in a cgroup
+    switch ((child_cgroup >= 0) ? LAUNCH_FORK : launch_method) {
+#ifdef USE_SPAWN
+    case LAUNCH_SPAWN:
+        return launch_spawn(file, argv, dups, ndups);
+#endif
+    default:
+        return launch_fork(file, argv, dups, ndups, -1);
+    }
+}
+
+// Prepares an invocation of the command ahead of time: the child is
+// forked and set up, and waits to exec until launch_release() is
+// given *release_fd, so that starting it then costs one write.
+// Returns the child pid, or -1 with errno set.
+pid_t
+launch_prepare(const char *file, char *const argv[],
+               const struct launch_dup *dups, int ndups, int *release_fd) {
+    int gate[2];
+
+    if (pipe2(gate, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    pid_t child_pid = launch_fork(file, argv, dups, ndups, gate[0]);
+    int saved = errno;
+    close(gate[0]);
+    if (child_pid < 0) {
+        close(gate[1]);
+        errno = saved;
+        return -1;
+    }
+    *release_fd = gate[1];
+    return child_pid;
+}
+
+// Lets a prepared child go on to exec the command.  Returns false if
+// it has already died.
+bool
+launch_release(int release_fd) {
+    bool ok = write(release_fd, "", 1) == 1;
+
+    close(release_fd);
+    return ok;
+}
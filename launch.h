@@ -0,0 +1,37 @@
+#ifndef REPEAT_LAUNCH_H
+#define REPEAT_LAUNCH_H
+
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Ways of starting a child process.  posix_spawn avoids copying the
+// parent's page tables on every invocation, which fork() must do.
+enum launch_method {
+    LAUNCH_FORK,
+    LAUNCH_SPAWN,
+};
+
+extern enum launch_method launch_method;
+
+// A descriptor to install in the child, as if by dup2(from, to).
+// These are applied in order.
+struct launch_dup {
+    int from;
+    int to;
+};
+
+bool launch_set_method(const char *name);
+const char *launch_method_name(void);
+void launch_init(const sigset_t *child_mask, bool new_pgroup);
+void launch_set_cpus(const cpu_set_t *cpus);
+void launch_set_cgroup(int fd);
+void launch_set_stamp(int fd);
+pid_t launch_command(const char *file, char *const argv[],
+                     const struct launch_dup *dups, int ndups);
+pid_t launch_prepare(const char *file, char *const argv[],
+                     const struct launch_dup *dups, int ndups, int *release_fd);
+bool launch_release(int release_fd);
+
+#endif
@@ -0,0 +1,255 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+#include "output.h"
+
+// The log file which output from every invocation is collected in.
+// Output is moved into it from each child's pipe with splice(), so it
+// never passes through a buffer in this process.
+static const char *log_path = NULL;
+static int log_fd = -1;
+static uint64_t log_size = 0;
+static uint64_t log_max_size = 0;
+static int log_keep = 0;
+static uint64_t last_iteration = 0;
+static bool use_splice = true;
+
+static bool
+output_reopen(void) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (log_fd < 0) {
+        return false;
+    }
+    // O_APPEND would make splice() fail, so keep our own position at
+    // the end instead.
+    off_t end = lseek(log_fd, 0, SEEK_END);
+    log_size = (end > 0) ? end : 0;
+    return true;
+}
+
+bool
+output_open(const char *path, uint64_t max_size, int keep) {
+    log_path = path;
+    log_max_size = max_size;
+    log_keep = keep;
+    return output_reopen();
+}
+
+// Renames FILE to FILE.1, FILE.1 to FILE.2, and so on, dropping the
+// oldest, then starts a new FILE.
+static void
+output_rotate(void) {
+    size_t len = strlen(log_path) + 16;
+    char *from = malloc(len);
+    char *to = malloc(len);
+
+    close(log_fd);
+    for (int i = log_keep; i > 0; i--) {
+        if (i == 1) {
+            snprintf(from, len, "%s", log_path);
+        } else {
+            snprintf(from, len, "%s.%d", log_path, i - 1);
+        }
+        snprintf(to, len, "%s.%d", log_path, i);
+        rename(from, to);
+    }
+    if (log_keep == 0) {
+        unlink(log_path);
+    }
+    free(from);
+    free(to);
+    last_iteration = 0;
+    if (!output_reopen()) {
+        fprintf(stderr, "Couldn't reopen %s: %s\n", log_path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void
+write_header(uint64_t iteration) {
+    char header[128];
+    struct timespec now;
+    struct tm tm;
+    char stamp[32];
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    int len = snprintf(header, sizeof(header), "==> iteration %" PRIu64 " at %s.%06ldZ <==\n",
+                       iteration, stamp, now.tv_nsec / 1000);
+    if (write(log_fd, header, len) == len) {
+        log_size += len;
+    }
+    last_iteration = iteration;
+}
+
+// Falls back to copying through a buffer for logs which splice()
+// can't write to.
+static ssize_t
+copy_chunk(int fd) {
+    char buf[65536];
+    ssize_t len = read(fd, buf, sizeof(buf));
+
+    if (len > 0 && write(log_fd, buf, len) != len) {
+        return -1;
+    }
+    return len;
+}
+
+// Moves output waiting in the pipe fd into the log, attributed to the
+// given iteration.  A header is written whenever the log switches to
+// a different iteration's output.  With drain, keeps going until the
+// pipe is empty rather than moving a single chunk.  Returns false on a
+// write error.
+bool
+output_copy(int fd, uint64_t iteration, bool drain) {
+    do {
+        ssize_t len;
+        int avail;
+
+        // Only write a header if there's output to follow it
+        if (ioctl(fd, FIONREAD, &avail) < 0 || avail == 0) {
+            break;
+        }
+        if (iteration != last_iteration) {
+            write_header(iteration);
+        }
+        if (use_splice) {
+            len = splice(fd, NULL, log_fd, NULL, avail, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len < 0 && errno == EINVAL) {
+                use_splice = false;
+                len = copy_chunk(fd);
+            }
+        } else {
+            len = copy_chunk(fd);
+        }
+        if (len < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        if (len == 0) {
+            break;
+        }
+        log_size += len;
+        if (log_max_size > 0 && log_size >= log_max_size) {
+            output_rotate();
+        }
+    } while (drain);
+    return true;
+}
+
+// Hash of the last captured output, to compare the next one against.
+static uint64_t last_hash = 0;
+static bool have_last_hash = false;
+
+static int
+open_spool(void) {
+    const char *dir = getenv("TMPDIR");
+    int fd;
+
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        FILE *f = tmpfile();
+        fd = (f != NULL) ? dup(fileno(f)) : -1;
+        if (f != NULL) {
+            fclose(f);
+        }
+    }
+    return fd;
+}
+
+static bool
+capture_open(struct capture *c) {
+    if (c->spool_fd < 0) {
+        c->spool_fd = open_spool();
+        if (c->spool_fd < 0) {
+            return false;
+        }
+        xxh64_init(&c->hash, 0);
+    }
+    return true;
+}
+
+// Hashes output waiting in the pipe fd and stores it in the spool.
+// With drain, keeps going until the pipe is empty.  Returns false on
+// an error.
+bool
+capture_read(struct capture *c, int fd, bool drain) {
+    char buf[65536];
+
+    if (!capture_open(c)) {
+        return false;
+    }
+    do {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        if (len == 0) {
+            break;
+        }
+        xxh64_update(&c->hash, buf, len);
+        if (write(c->spool_fd, buf, len) != len) {
+            return false;
+        }
+    } while (drain);
+    return true;
+}
+
+// Ends the capture of one invocation's output.  If it differs from the
+// previous invocation's, it is copied to stdout.  Returns 1 if the
+// output changed, 0 if it was the same or there was no previous
+// output to compare with, and -1 on an error.
+int
+capture_finish(struct capture *c) {
+    int changed = 0;
+
+    if (!capture_open(c)) {
+        return -1;
+    }
+    uint64_t hash = xxh64_digest(&c->hash);
+    if (!have_last_hash || hash != last_hash) {
+        fflush(stdout);
+        off_t size = lseek(c->spool_fd, 0, SEEK_CUR);
+        off_t offset = 0;
+        while (offset < size) {
+            ssize_t len = sendfile(STDOUT_FILENO, c->spool_fd, &offset, size - offset);
+            if (len < 0 && errno == EINVAL) {
+                // stdout may be opened for appending, which sendfile()
+                // refuses, so copy the rest through a buffer.
+                char buf[65536];
+                len = pread(c->spool_fd, buf, sizeof(buf), offset);
+                if (len > 0 && write(STDOUT_FILENO, buf, len) != len) {
+                    len = -1;
+                }
+                offset += (len > 0) ? len : 0;
+            }
+            if (len <= 0) {
+                changed = -1;
+                break;
+            }
+        }
+        if (changed == 0 && have_last_hash) {
+            changed = 1;
+        }
+        last_hash = hash;
+        have_last_hash = true;
+    }
+    if (ftruncate(c->spool_fd, 0) < 0 || lseek(c->spool_fd, 0, SEEK_SET) < 0) {
+        changed = -1;
+    }
+    xxh64_init(&c->hash, 0);
+    return changed;
+}
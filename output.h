@@ -0,0 +1,22 @@
+#ifndef REPEAT_OUTPUT_H
+#define REPEAT_OUTPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+bool output_open(const char *path, uint64_t max_size, int keep);
+bool output_copy(int fd, uint64_t iteration, bool drain);
+
+// The output of one invocation, hashed as it arrives and held in an
+// unlinked temporary file until we know whether it has changed.
+struct capture {
+    int spool_fd;           // -1 until first used
+    struct xxh64 hash;
+};
+
+bool capture_read(struct capture *c, int fd, bool drain);
+int capture_finish(struct capture *c);
+
+#endif
@@ -0,0 +1,266 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "duration.h"
+#include "record.h"
+
+// Where a record of every finished invocation is kept.  JSONL records
+// are gathered in a buffer and written a batch at a time, and ring
+// records are stored straight into a shared mapping of the file, so
+// neither costs a system call per invocation.
+static enum record_format record_format;
+static int record_fd = -1;
+static char jsonl_buf[65536];
+static size_t jsonl_len = 0;
+static struct record_ring_header *ring = NULL;
+static struct record *ring_records = NULL;
+// When the oldest JSONL record waiting in the buffer was added
+static struct timespec buffered_since;
+
+// Added to CLOCK_MONOTONIC times to turn them into wall clock time
+static int64_t epoch_offset_ns;
+
+// Maps a ring file which is already size bytes long, if its header
+// says it is a ring of capacity records of this build's layout.
+static bool
+ring_reopen(size_t size, uint32_t capacity) {
+    struct stat st;
+
+    if (fstat(record_fd, &st) < 0 || st.st_size != (off_t)size) {
+        return false;
+    }
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return false;
+    }
+    if (memcmp(ring->magic, RECORD_MAGIC, sizeof(ring->magic)) != 0 ||
+        ring->record_size != sizeof(struct record) || ring->capacity != capacity) {
+        munmap(ring, size);
+        ring = NULL;
+        return false;
+    }
+    ring_records = (struct record *)(ring + 1);
+    return true;
+}
+
+// Sets up the ring, keeping the records already in it when append is
+// set and it is a ring of the same size, or else starting an empty one.
+static bool
+ring_open(uint32_t capacity, bool append) {
+    size_t size = sizeof(*ring) + (size_t)capacity * sizeof(struct record);
+    int err;
+
+    if (append && ring_reopen(size, capacity)) {
+        return true;
+    }
+    if (ftruncate(record_fd, 0) < 0) {
+        return false;
+    }
+    // Allocating the blocks now means a full disk can't turn into
+    // SIGBUS on a later store.
+    if ((err = posix_fallocate(record_fd, 0, size)) != 0) {
+        errno = err;
+        return false;
+    }
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return false;
+    }
+    memcpy(ring->magic, RECORD_MAGIC, sizeof(ring->magic));
+    ring->record_size = sizeof(struct record);
+    ring->capacity = capacity;
+    ring->written = 0;
+    ring_records = (struct record *)(ring + 1);
+    return true;
+}
+
+static void
+set_epoch_offset(void) {
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    epoch_offset_ns = timespec_to_ns(&real) - timespec_to_ns(&mono);
+}
+
+// Opens path to write records to.  The file is started afresh, so that
+// it only holds one run's records, unless append asks for them to
+// follow what's there.
+bool
+record_open(const char *path, enum record_format format, uint32_t capacity, bool append) {
+    set_epoch_offset();
+    record_format = format;
+    int flags = O_CREAT | O_CLOEXEC |
+                ((format == RECORD_RING) ? O_RDWR : O_WRONLY | O_APPEND | ((append) ? 0 : O_TRUNC));
+    record_fd = open(path, flags, 0666);
+    if (record_fd < 0) {
+        return false;
+    }
+    if (format == RECORD_RING && !ring_open(capacity, append)) {
+        int saved = errno;
+        close(record_fd);
+        record_fd = -1;
+        errno = saved;
+        return false;
+    }
+    return true;
+}
+
+// Writes JSONL records to fd, which is already open, such as a pipe
+// to the coordinator of a --hosts run.
+void
+record_open_fd(int fd) {
+    set_epoch_offset();
+    record_format = RECORD_JSONL;
+    record_fd = fd;
+}
+
+// Returns whether JSONL records are waiting to be written, and if so,
+// when the oldest of them was added.
+bool
+record_pending(struct timespec *since) {
+    if (jsonl_len == 0) {
+        return false;
+    }
+    *since = buffered_since;
+    return true;
+}
+
+// Writes out the JSONL records gathered so far.
+bool
+record_flush(void) {
+    size_t done = 0;
+
+    while (done < jsonl_len) {
+        ssize_t len = write(record_fd, jsonl_buf + done, jsonl_len - done);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += len;
+    }
+    jsonl_len = 0;
+    return true;
+}
+
+static int64_t
+epoch_ns(const struct timespec *ts) {
+    return timespec_to_ns(ts) + epoch_offset_ns;
+}
+
+static int64_t
+timeval_us(const struct timeval *tv) {
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+// Records an invocation which ran from start to end with the given
+// wait() status.  usage may be NULL if it isn't known.
+bool
+record_add(uint64_t iteration, const struct timespec *scheduled,
+           const struct timespec *start, const struct timespec *end,
+           int status, bool timed_out, const struct rusage *usage) {
+    struct timespec elapsed = timespec_sub(end, start);
+    struct record rec = {
+        .iteration = iteration,
+        .scheduled_ns = epoch_ns(scheduled),
+        .start_ns = epoch_ns(start),
+        .duration_ns = timespec_to_ns(&elapsed),
+        .status = status,
+        .flags = ((timed_out) ? RECORD_TIMED_OUT : 0) |
+                 ((usage != NULL) ? RECORD_HAVE_USAGE : 0),
+    };
+
+    if (usage != NULL) {
+        rec.user_us = timeval_us(&usage->ru_utime);
+        rec.system_us = timeval_us(&usage->ru_stime);
+        rec.maxrss_kb = usage->ru_maxrss;
+    }
+    if (record_format == RECORD_RING) {
+        ring_records[ring->written % ring->capacity] = rec;
+        // Readers find the record through the count, so it has to be
+        // in place before the count says so.
+        __atomic_store_n(&ring->written, ring->written + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Leave room for the largest record a line can hold
+    if (sizeof(jsonl_buf) - jsonl_len < 512 && !record_flush()) {
+        return false;
+    }
+    if (jsonl_len == 0) {
+        buffered_since = *end;
+    }
+    char *p = jsonl_buf + jsonl_len;
+    size_t room = sizeof(jsonl_buf) - jsonl_len;
+    int len = snprintf(p, room, "{\"iteration\":%" PRIu64 ",\"scheduled_ns\":%" PRId64
+                       ",\"start_ns\":%" PRId64 ",\"duration_ns\":%" PRId64,
+                       rec.iteration, rec.scheduled_ns, rec.start_ns, rec.duration_ns);
+    if (WIFEXITED(status)) {
+        len += snprintf(p + len, room - len, ",\"exit\":%d", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        len += snprintf(p + len, room - len, ",\"signal\":%d", WTERMSIG(status));
+    }
+    len += snprintf(p + len, room - len, ",\"timed_out\":%s", (timed_out) ? "true" : "false");
+    if (usage != NULL) {
+        len += snprintf(p + len, room - len, ",\"user_us\":%" PRId64 ",\"system_us\":%" PRId64
+                        ",\"maxrss_kb\":%" PRId64,
+                        rec.user_us, rec.system_us, rec.maxrss_kb);
+    }
+    len += snprintf(p + len, room - len, "}\n");
+    jsonl_len += len;
+    return true;
+}
+
+// Copies str into p as the inside of a JSON string, escaping what
+// needs it, and returns the end of the copy.  Takes at most six bytes
+// for each of str.
+static char *
+json_escape_to(char *p, const char *str) {
+    for (const unsigned char *s = (const unsigned char *)str; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            *p++ = '\\';
+            *p++ = *s;
+        } else if (*s < 0x20) {
+            p += sprintf(p, "\\u%04x", *s);
+        } else {
+            *p++ = *s;
+        }
+    }
+    return p;
+}
+
+// Copies a JSONL record which a worker on host sent, adding the host
+// it came from as the first field.
+bool
+record_add_host(const char *host, const char *line, const struct timespec *now) {
+    size_t len = 6 * strlen(host) + strlen(line) + 16;
+
+    if (sizeof(jsonl_buf) - jsonl_len < len && !record_flush()) {
+        return false;
+    }
+    if (len > sizeof(jsonl_buf)) {
+        errno = E2BIG;
+        return false;
+    }
+    if (jsonl_len == 0) {
+        buffered_since = *now;
+    }
+    char *p = stpcpy(jsonl_buf + jsonl_len, "{\"host\":\"");
+    p = json_escape_to(p, host);
+    p += sprintf(p, "\",%s\n", line + 1);
+    jsonl_len = p - jsonl_buf;
+    return true;
+}
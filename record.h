@@ -0,0 +1,54 @@
+#ifndef REPEAT_RECORD_H
+#define REPEAT_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+enum record_format {
+    RECORD_JSONL,   // one JSON object per line
+    RECORD_RING,    // fixed-size records in a memory-mapped file
+};
+
+#define RECORD_MAGIC "REPEATR1"
+
+// Set in record.flags
+#define RECORD_TIMED_OUT    0x1     // killed by --timeout
+#define RECORD_HAVE_USAGE   0x2     // the rusage fields are filled in
+
+// One finished invocation, as laid out in a ring file.  Times are in
+// nanoseconds since the Unix epoch.  Resource usage can't be measured
+// for invocations run by a coprocess, which leave it zero.
+struct record {
+    uint64_t iteration;
+    int64_t scheduled_ns;       // when the schedule wanted it to start
+    int64_t start_ns;           // when it did start
+    int64_t duration_ns;
+    int32_t status;             // as returned by wait()
+    uint32_t flags;
+    int64_t user_us;
+    int64_t system_us;
+    int64_t maxrss_kb;
+};
+
+// The start of a ring file, followed by capacity records.  The latest
+// record is at index (written - 1) % capacity.
+struct record_ring_header {
+    char magic[8];
+    uint32_t record_size;       // sizeof(struct record)
+    uint32_t capacity;
+    uint64_t written;           // records written since the file was created
+    uint64_t reserved[5];
+};
+
+bool record_open(const char *path, enum record_format format, uint32_t capacity, bool append);
+void record_open_fd(int fd);
+bool record_add(uint64_t iteration, const struct timespec *scheduled,
+                const struct timespec *start, const struct timespec *end,
+                int status, bool timed_out, const struct rusage *usage);
+bool record_add_host(const char *host, const char *line, const struct timespec *now);
+bool record_pending(struct timespec *since);
+bool record_flush(void);
+
+#endif
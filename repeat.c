@@ -1,7 +1,10 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -9,8 +12,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+#include "affinity.h"
+#include "args.h"
+#include "cache.h"
+#include "cgroup.h"
+#include "control.h"
+#include "duration.h"
+#include "evloop.h"
+#include "fanout.h"
+#include "launch.h"
+#include "output.h"
+#include "record.h"
+#include "hash.h"
+#include "shell.h"
+#include "state.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
+
 const char *REPEAT_VERSION =
     PACKAGE_STRING "\n\n"
     "Written by Daniel Lowe.\n";
@@ -18,16 +44,82 @@ const char *REPEAT_VERSION =
 const char *USAGE =
     "Repeatedly call COMMAND forever, or until specified option.\n"
     "\n"
-    "Usage: %1$s [-ehipx] [--times=<n>] [--interval=<n>] <command>\n"
+    "Usage: %1$s [-ehipx] [--times=<n>] [--interval=<n>] [--jobs=<n>] <command>\n"
     "\n"
     "Options:\n"
     "  -i, --interval=DURATION  specifies the interval between invocations.\n"
+    "                  DURATION is in seconds, or has units like 1m30s or 250ms\n"
     "  -t, --times=NUM          execute for number of times, then stop\n"
     "  -e, --untilerr           stop repeating when command's exit code is non-zero\n"
     "  -s, --untilsuccess       stop repeating when command's exit code is zero\n"
+    "  --until-stable=PCT  stop once the mean run time is known to within PCT\n"
+    "                  percent, with 95 percent confidence\n"
+    "  --warmup=NUM    leave the first NUM runs out of the statistics\n"
     "  -p, --precise   runs command at specified intervals instead of waiting\n"
     "                  the interval between executions\n"
+    "  --catchup=burst|skip|shift  what --precise does when runs fall behind\n"
+    "  --realtime[=PRIORITY]  schedule repeat itself SCHED_FIFO, with its\n"
+    "                  memory locked and no timer slack, for a steadier\n"
+    "                  --precise schedule\n"
+    "  --timer-slack=DURATION  how late the kernel may wake repeat\n"
+    "  --spin=DURATION  wake this early before each launch and wait out the\n"
+    "                  rest by polling the clock\n"
+    "  --backoff=exponential|linear  grow the interval after every run, with\n"
+    "                  random jitter\n"
+    "  --max-interval=DURATION  the most --backoff lets the interval grow to\n"
     "  -x, --noshell   runs command via exec() instead of via \"sh -c\"\n"
+    "  --args-from=FILE  run once for each line of FILE, or stdin for -, put\n"
+    "                  in place of {} in command, or on the end without one\n"
+    "  --batch=NUM     give each invocation NUM lines of --args-from at once\n"
+    "  -j, --jobs=NUM  keep NUM invocations of command running at once\n"
+    "  --compare=COMMAND  alternate runs of command with COMMAND, and report\n"
+    "                  how their run times differ\n"
+    "  --order=alternate|random  run each pair of --compare runs in turn, or\n"
+    "                  in random order\n"
+    "  --cpus=LIST     run invocations on the CPUs in LIST, like 0-3,8, one\n"
+    "                  each in turn with --jobs\n"
+    "  --numa-node=NUM allocate memory on NUMA node NUM, and run on its CPUs\n"
+    "                  unless --cpus is given\n"
+    "  --cgroup=DIR    run each job in a cgroup v2 leaf under DIR, and report\n"
+    "                  the memory and CPU each run used with --stats\n"
+    "  --memory-max=SIZE  limit each job's cgroup to SIZE bytes (K, M, G)\n"
+    "  --cpu-max=CPUS  limit each job's cgroup to CPUS worth of CPU time\n"
+    "  --prefork       fork each job's next child ahead of its launch time,\n"
+    "                  so that starting it only takes an exec\n"
+    "  --zygote        start command once, and have it fork a copy of itself\n"
+    "                  for each invocation (see REPEAT_ZYGOTE in repeat(1))\n"
+    "  -T, --timeout=DURATION  send SIGTERM to an invocation running longer\n"
+    "                  than DURATION; it counts as exiting with 124\n"
+    "  --kill-after=DURATION   send SIGKILL if it is still running DURATION\n"
+    "                  after that (default 10s)\n"
+    "  -r, --rate=NUM[/s|/m|/h]  start NUM invocations per second without\n"
+    "                  waiting for earlier ones, timing each from its\n"
+    "                  scheduled start (implies -p and -j 64)\n"
+    "  --launcher=fork|spawn  selects how child processes are started\n"
+    "  --stats[=text|json]    print run time statistics on exit or SIGUSR1\n"
+    "  --control=PATH         serve metrics and take commands on a Unix socket\n"
+    "  --trace=FILE           write a Chrome trace of what repeat spends time on\n"
+    "  -o, --output=FILE      collect the command's output in FILE\n"
+    "  --output-size=SIZE     rotate FILE when it reaches SIZE bytes (K, M, G)\n"
+    "  --output-keep=NUM      number of rotated files to keep (default 3)\n"
+    "  --state=FILE           keep the loop's progress and statistics in FILE,\n"
+    "                  and carry on from them when started again\n"
+    "  --record=FILE          write a record of every invocation to FILE\n"
+    "  --record-format=jsonl|ring  JSON lines (default), or a memory-mapped\n"
+    "                  ring of binary records\n"
+    "  --record-ring-size=NUM number of records a ring holds (default 65536)\n"
+    "  -c, --changed          only print output when it differs from the last run\n"
+    "  -u, --until-changed    stop repeating when the output changes\n"
+    "  --cache=PATH           reuse the last exit status instead of running\n"
+    "                  while PATH is unchanged; may be given more than once\n"
+    "  -w, --watch=PATH       run again whenever PATH changes, instead of\n"
+    "                  repeatedly; may be given more than once\n"
+    "  --debounce=DURATION    wait for changes to stop for DURATION before\n"
+    "                  running (default 100ms)\n"
+    "  --hosts=FILE    run on every host in FILE over ssh instead, stopping\n"
+    "                  them all on the first error with -e or success with -s\n"
+    "  --ssh=COMMAND   the ssh to reach the hosts with (default ssh)\n"
+    "  --worker        run as a worker for --hosts, which is done for you\n"
     "  -h, --help      display usage and exit\n"
     "  -v, --version   display version info and exit\n"
     "\n"
@@ -40,27 +132,193 @@ const char *USAGE =
     "                                           once a second, stopping if echo\n"
     "                                           returns an error.\n"
     ;
-const int32_t NS_IN_SEC = 1000000000;
 
 int times = 0;
 struct timespec interval_ts = { 0, 0 };
 bool precise = false;
+enum catchup_policy {
+    CATCHUP_BURST,      // run every missed tick back-to-back
+    CATCHUP_SKIP,       // drop missed ticks, staying on the original grid
+    CATCHUP_SHIFT,      // restart the schedule from the late run
+} catchup = CATCHUP_BURST;
+enum backoff_policy {
+    BACKOFF_NONE,
+    BACKOFF_EXPONENTIAL,    // double the interval after every run
+    BACKOFF_LINEAR,         // add the original interval after every run
+} backoff = BACKOFF_NONE;
+struct timespec max_interval_ts = { 0, 0 };
+int realtime_priority = 0;      // 0 for the normal scheduler
+struct timespec timer_slack_ts = { 0, 0 };
+bool timer_slack_given = false;
+struct timespec spin_ts = { 0, 0 };
 bool exit_on_error = false;
 bool exit_on_success = false;
+double until_stable = 0;
+uint64_t warmup_runs = 0;
 bool use_exec = false;
 bool debug = false;
-int cmd_arg_idx = 0;
+int jobs = 1;
+struct timespec timeout_ts = { 0, 0 };
+struct timespec kill_after_ts = { 10, 0 };
+bool use_timeout = false;
+bool jobs_given = false;
+double rate = 0;
+char *cmd_file = NULL;
+char **cmd_argv = NULL;
 char *command = NULL;
+char *shell_argv[] = { "sh", "-c", NULL, NULL };
+char *compare_command = NULL;
+char *compare_file = NULL;
+char **compare_argv = NULL;
+char *compare_shell_argv[] = { "sh", "-c", NULL, NULL };
+enum compare_order {
+    ORDER_ALTERNATE,    // a, b, a, b, ...
+    ORDER_RANDOM,       // a or b first, at random, in each pair
+} compare_order = ORDER_ALTERNATE;
+char *args_path = NULL;
+int args_batch = 1;
+bool use_coproc = false;
+bool use_zygote = false;
+bool use_prefork = false;
+bool use_cpus = false;
+cpu_set_t cpu_list;
+int numa_node = -1;
+char *cgroup_path = NULL;
+uint64_t memory_max = 0;
+double cpu_max = 0;
+enum stats_format stats_format = STATS_NONE;
+char *output_path = NULL;
+uint64_t output_size = 0;
+int output_keep = 3;
+char *control_path = NULL;
+char *trace_path = NULL;
+char *state_path = NULL;
+uint64_t command_hash = 0;      // what a --state file must have been written for
+char *record_path = NULL;
+enum record_format record_format = RECORD_JSONL;
+uint32_t record_ring_size = 65536;
+bool only_changed = false;
+bool exit_on_change = false;
+bool watching = false;
+bool caching = false;
+struct timespec debounce_ts = { 0, 100000000 };
+char *hosts_path = NULL;
+char *ssh_command = "ssh";
+char **worker_argv = NULL;
+bool worker = false;
+// How long a worker holds records before sending them as a batch
+struct timespec worker_batch_ts = { 0, 100000000 };
 
-bool
-parse_arguments(int argc, char *argv[], int *return_val) {
+// Parses a byte count with an optional K, M or G multiplier.
+static bool
+parse_size(const char *str, uint64_t *result) {
+    char *endp;
+    unsigned long long value = strtoull(str, &endp, 10);
+    int shift = 0;
+
+    if (endp == str || *str == '-') {
+        return false;
+    }
+    switch (*endp) {
+    case '\0':
+        break;
+    case 'K': case 'k':
+        shift = 10; endp++; break;
+    case 'M': case 'm':
+        shift = 20; endp++; break;
+    case 'G': case 'g':
+        shift = 30; endp++; break;
+    default:
+        return false;
+    }
+    if (*endp != '\0' || value > (UINT64_MAX >> shift)) {
+        return false;
+    }
+    *result = (uint64_t)value << shift;
+    return true;
+}
+
+// Parses a rate of invocations per second, or per minute or hour with
+// a /m or /h suffix.  Returns NULL, or what was wrong with it.
+static const char *
+parse_rate(const char *str, double *result) {
+    char *endp;
+    double value = strtod(str, &endp);
+
+    if (endp == str || !(value > 0)) {
+        return "Rate must be a positive number.";
+    }
+    if (strcmp(endp, "/m") == 0) {
+        value /= 60;
+    } else if (strcmp(endp, "/h") == 0) {
+        value /= 3600;
+    } else if (*endp != '\0' && strcmp(endp, "/s") != 0) {
+        return "Bad unit for rate - must be one of /s, /m, or /h.";
+    }
+    *result = value;
+    return NULL;
+}
+
+// The interval between ticks which gives a rate
+static struct timespec
+rate_interval(double per_sec) {
+    double ns = NS_IN_SEC / per_sec;
+    return timespec_from_ns((ns >= 1) ? (int64_t)ns : 1);
+}
+
+// Parses the options, marking in local_arg the arguments which a
+// --hosts coordinator keeps for itself.
+static bool
+parse_options(int argc, char *argv[], int *return_val, bool *local_arg) {
     struct option long_options[] = {
         { "times", required_argument, NULL, 't' },
         { "interval", required_argument, NULL, 'i' },
         { "precise", no_argument, NULL, 'p' },
+        { "catchup", required_argument, NULL, 'C' },
+        { "realtime", optional_argument, NULL, 'y' },
+        { "timer-slack", required_argument, NULL, 'l' },
+        { "spin", required_argument, NULL, 'q' },
+        { "backoff", required_argument, NULL, 'B' },
+        { "max-interval", required_argument, NULL, 'M' },
         { "untilerr", no_argument, NULL, 'e' },
         { "untilsuccess", no_argument, NULL, 's' },
+        { "until-stable", required_argument, NULL, 'a' },
+        { "warmup", required_argument, NULL, 'n' },
         { "noshell", no_argument, NULL, 'x' },
+        { "args-from", required_argument, NULL, 'I' },
+        { "batch", required_argument, NULL, 'J' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "compare", required_argument, NULL, 'b' },
+        { "order", required_argument, NULL, 'g' },
+        { "rate", required_argument, NULL, 'r' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "kill-after", required_argument, NULL, 'k' },
+        { "launcher", required_argument, NULL, 'L' },
+        { "zygote", no_argument, NULL, 'Y' },
+        { "prefork", no_argument, NULL, 'f' },
+        { "cpus", required_argument, NULL, 'P' },
+        { "numa-node", required_argument, NULL, 'U' },
+        { "cgroup", required_argument, NULL, 'G' },
+        { "memory-max", required_argument, NULL, 'W' },
+        { "cpu-max", required_argument, NULL, 'Q' },
+        { "stats", optional_argument, NULL, 'S' },
+        { "control", required_argument, NULL, 'X' },
+        { "trace", required_argument, NULL, 'A' },
+        { "output", required_argument, NULL, 'o' },
+        { "output-size", required_argument, NULL, 'Z' },
+        { "output-keep", required_argument, NULL, 'K' },
+        { "state", required_argument, NULL, 'v' },
+        { "record", required_argument, NULL, 'R' },
+        { "record-format", required_argument, NULL, 'F' },
+        { "record-ring-size", required_argument, NULL, 'N' },
+        { "changed", no_argument, NULL, 'c' },
+        { "until-changed", no_argument, NULL, 'u' },
+        { "watch", required_argument, NULL, 'w' },
+        { "debounce", required_argument, NULL, 'D' },
+        { "cache", required_argument, NULL, 'm' },
+        { "hosts", required_argument, NULL, 'H' },
+        { "ssh", required_argument, NULL, 'E' },
+        { "worker", no_argument, NULL, 'O' },
         { "version", no_argument, NULL, 'V' },
         { "help", no_argument, NULL, 'h' },
         { NULL, 0, NULL, 0 }
@@ -68,7 +326,7 @@ parse_arguments(int argc, char *argv[], int *return_val) {
     int option_idx = 0;
     char c;
     char *endp;
-    float interval;
+    int first = optind;
 
     *return_val = 0;
     opterr = 1;
@@ -77,7 +335,15 @@ parse_arguments(int argc, char *argv[], int *return_val) {
     // processing options at the first non-option, which is what we
     // want for the subcommand.
     setenv("POSIXLY_CORRECT", "", false);
-    while ((c = getopt_long(argc, argv, "t:i:eszdhpVx", long_options, &option_idx)) != -1) {
+    while ((c = getopt_long(argc, argv, "t:i:j:r:T:o:w:cueszdhpVx", long_options, &option_idx)) != -1) {
+        // Only long options are local, and those always take up whole
+        // arguments.
+        if (strchr("HESRFNan", c) != NULL) {
+            for (int i = first; i < optind; i++) {
+                local_arg[i] = true;
+            }
+        }
+        first = optind;
         switch (c) {
         case '?':
             return 1;
@@ -93,34 +359,82 @@ parse_arguments(int argc, char *argv[], int *return_val) {
             printf("Debug enabled.\n");
             debug = true; break;
         case 'i':
-            interval = strtof(optarg, &endp);
-            if (endp == optarg) {
-                fprintf(stderr, USAGE, argv[0]);
+            if (!parse_duration(optarg, &interval_ts)) {
+                fprintf(stderr, "Bad interval - must be a number of seconds, or numbers\n"
+                        "with units of d, h, m, s, ms, us or ns, like 1m30s.\n");
                 *return_val = 1;
                 return true;
             }
-            if (*endp != '\0') {
-                switch (*endp) {
-                case 'd':
-                    interval *= 86400; break;
-                case 'h':
-                    interval *= 3600; break;
-                case 'm':
-                    interval *= 60; break;
-                case 's':
-                    break;
-                default:
-                    fprintf(stderr, "Bad unit for interval - must be one of d, h, m, or s.\n");
-                    *return_val = 1;
-                    return true;
-                }
-            }
-            interval_ts.tv_sec = (int)interval;
-            interval_ts.tv_nsec = (interval - (int)interval) * NS_IN_SEC;
             break;
         case 'p':
             precise = true;
             break;
+        case 'T':
+        case 'k':
+            if (!parse_duration(optarg, (c == 'T') ? &timeout_ts : &kill_after_ts)) {
+                fprintf(stderr, "Bad %s - must be a number of seconds, or numbers\n"
+                        "with units of d, h, m, s, ms, us or ns, like 1m30s.\n",
+                        (c == 'T') ? "timeout" : "kill-after");
+                *return_val = 1;
+                return true;
+            }
+            use_timeout = timeout_ts.tv_sec || timeout_ts.tv_nsec;
+            break;
+        case 'C':
+            if (strcmp(optarg, "burst") == 0) {
+                catchup = CATCHUP_BURST;
+            } else if (strcmp(optarg, "skip") == 0) {
+                catchup = CATCHUP_SKIP;
+            } else if (strcmp(optarg, "shift") == 0) {
+                catchup = CATCHUP_SHIFT;
+            } else {
+                fprintf(stderr, "Catchup policy must be one of burst, skip, or shift.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'y': {
+            int lo = sched_get_priority_min(SCHED_FIFO);
+            int hi = sched_get_priority_max(SCHED_FIFO);
+            realtime_priority = (optarg != NULL) ? strtol(optarg, &endp, 10) : 10;
+            if ((optarg != NULL && (endp == optarg || *endp != '\0')) ||
+                realtime_priority < lo || realtime_priority > hi) {
+                fprintf(stderr, "Realtime priority must be from %d to %d.\n", lo, hi);
+                *return_val = 1;
+                return true;
+            }
+            break;
+        }
+        case 'l':
+        case 'q':
+            if (!parse_duration(optarg, (c == 'l') ? &timer_slack_ts : &spin_ts)) {
+                fprintf(stderr, "Bad %s - must be a number of seconds, or numbers\n"
+                        "with units of d, h, m, s, ms, us or ns, like 1m30s.\n",
+                        (c == 'l') ? "timer slack" : "spin");
+                *return_val = 1;
+                return true;
+            }
+            timer_slack_given |= c == 'l';
+            break;
+        case 'B':
+            if (strcmp(optarg, "exponential") == 0) {
+                backoff = BACKOFF_EXPONENTIAL;
+            } else if (strcmp(optarg, "linear") == 0) {
+                backoff = BACKOFF_LINEAR;
+            } else {
+                fprintf(stderr, "Backoff must be one of exponential or linear.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'M':
+            if (!parse_duration(optarg, &max_interval_ts)) {
+                fprintf(stderr, "Bad max interval - must be a number of seconds, or numbers\n"
+                        "with units of d, h, m, s, ms, us or ns, like 1m30s.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
         case 'e':
             exit_on_error = true;
             break;
@@ -130,6 +444,218 @@ parse_arguments(int argc, char *argv[], int *return_val) {
         case 'x':
             use_exec = true;
             break;
+        case 'Y':
+            use_zygote = true;
+            break;
+        case 'f':
+            use_prefork = true;
+            break;
+        case 'I':
+            args_path = optarg;
+            break;
+        case 'b':
+            compare_command = optarg;
+            break;
+        case 'g':
+            if (strcmp(optarg, "alternate") == 0) {
+                compare_order = ORDER_ALTERNATE;
+            } else if (strcmp(optarg, "random") == 0) {
+                compare_order = ORDER_RANDOM;
+            } else {
+                fprintf(stderr, "Order must be one of alternate or random.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'a':
+            until_stable = strtod(optarg, &endp);
+            if (endp != optarg && *endp == '%') {
+                endp++;
+            }
+            if (endp == optarg || *endp != '\0' || !(until_stable > 0 && until_stable < 100)) {
+                fprintf(stderr, "Stable threshold must be a percentage between 0 and 100.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'n':
+            if (*optarg == '-' || (warmup_runs = strtoull(optarg, &endp, 10), endp == optarg) ||
+                *endp != '\0') {
+                fprintf(stderr, "Warmup must be a number of runs.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'J':
+            args_batch = strtol(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || args_batch < 1) {
+                fprintf(stderr, "Batch size must be a positive integer.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'P':
+            if (!affinity_parse(optarg, &cpu_list)) {
+                fprintf(stderr, "Bad CPU list - must be CPU numbers and ranges, like 0-3,8.\n");
+                *return_val = 1;
+                return true;
+            }
+            use_cpus = true;
+            break;
+        case 'U':
+            numa_node = strtol(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || numa_node < 0) {
+                fprintf(stderr, "NUMA node must be a non-negative integer.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'j':
+            jobs = strtol(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || jobs < 1) {
+                fprintf(stderr, "Number of jobs must be a positive integer.\n");
+                *return_val = 1;
+                return true;
+            }
+            jobs_given = true;
+            break;
+        case 'r': {
+            const char *err = parse_rate(optarg, &rate);
+            if (err != NULL) {
+                fprintf(stderr, "%s\n", err);
+                *return_val = 1;
+                return true;
+            }
+            break;
+        }
+        case 'L':
+            if (!launch_set_method(optarg)) {
+                fprintf(stderr, "Unsupported launcher '%s'.\n", optarg);
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'S':
+            if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                stats_format = STATS_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_format = STATS_JSON;
+            } else {
+                fprintf(stderr, "Stats format must be one of text or json.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'Z':
+            if (!parse_size(optarg, &output_size)) {
+                fprintf(stderr, "Bad output size - must be a number of bytes, optionally\n"
+                        "followed by K, M or G.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'K':
+            output_keep = strtol(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || output_keep < 0) {
+                fprintf(stderr, "Number of output files to keep must be a non-negative integer.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'G':
+            cgroup_path = optarg;
+            break;
+        case 'W':
+            if (!parse_size(optarg, &memory_max) || memory_max == 0) {
+                fprintf(stderr, "Bad memory limit - must be a number of bytes, optionally\n"
+                        "followed by K, M or G.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'Q':
+            cpu_max = strtod(optarg, &endp);
+            if (endp == optarg || *endp != '\0' || !(cpu_max > 0)) {
+                fprintf(stderr, "CPU limit must be a positive number of CPUs.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'X':
+            control_path = optarg;
+            break;
+        case 'v':
+            state_path = optarg;
+            break;
+        case 'A':
+            trace_path = optarg;
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "jsonl") == 0) {
+                record_format = RECORD_JSONL;
+            } else if (strcmp(optarg, "ring") == 0) {
+                record_format = RECORD_RING;
+            } else {
+                fprintf(stderr, "Record format must be one of jsonl or ring.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'N': {
+            unsigned long n = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || *optarg == '-' || n < 1 || n > UINT32_MAX) {
+                fprintf(stderr, "Record ring size must be a positive integer.\n");
+                *return_val = 1;
+                return true;
+            }
+            record_ring_size = n;
+            break;
+        }
+        case 'u':
+            exit_on_change = true;
+            // fall through
+        case 'c':
+            only_changed = true;
+            break;
+        case 'w':
+            if (!watch_add(optarg)) {
+                fprintf(stderr, "Out of memory\n");
+                *return_val = 1;
+                return true;
+            }
+            watching = true;
+            break;
+        case 'm':
+            if (!cache_add(optarg)) {
+                fprintf(stderr, "Out of memory\n");
+                *return_val = 1;
+                return true;
+            }
+            caching = true;
+            break;
+        case 'D':
+            if (!parse_duration(optarg, &debounce_ts)) {
+                fprintf(stderr, "Bad debounce - must be a number of seconds, or numbers\n"
+                        "with units of d, h, m, s, ms, us or ns, like 1m30s.\n");
+                *return_val = 1;
+                return true;
+            }
+            break;
+        case 'H':
+            hosts_path = optarg;
+            break;
+        case 'E':
+            ssh_command = optarg;
+            break;
+        case 'O':
+            worker = true;
+            break;
         case 'V':
             printf("%s", REPEAT_VERSION);
             return true;
@@ -143,6 +669,102 @@ parse_arguments(int argc, char *argv[], int *return_val) {
         }
     }
 
+    // An open-loop rate is a precise schedule which doesn't wait for
+    // earlier runs, so it needs room for several of them at once.
+    if (rate > 0) {
+        if (interval_ts.tv_sec || interval_ts.tv_nsec) {
+            fprintf(stderr, "Only one of --rate and --interval may be given.\n");
+            *return_val = 1;
+            return true;
+        }
+        interval_ts = rate_interval(rate);
+        precise = true;
+        if (!jobs_given) {
+            jobs = 64;
+        }
+    }
+
+    if (backoff != BACKOFF_NONE) {
+        if (rate > 0) {
+            fprintf(stderr, "Only one of --rate and --backoff may be given.\n");
+            *return_val = 1;
+            return true;
+        }
+        if (interval_ts.tv_sec == 0 && interval_ts.tv_nsec == 0) {
+            fprintf(stderr, "--backoff needs an --interval to start from.\n");
+            *return_val = 1;
+            return true;
+        }
+    }
+
+    if (watching && precise) {
+        fprintf(stderr, "--watch can't be combined with --precise or --rate.\n");
+        *return_val = 1;
+        return true;
+    }
+
+    if (cgroup_path == NULL && (memory_max > 0 || cpu_max > 0)) {
+        fprintf(stderr, "--memory-max and --cpu-max need --cgroup.\n");
+        *return_val = 1;
+        return true;
+    }
+
+    if (args_path != NULL && caching) {
+        fprintf(stderr, "--args-from can't be combined with --cache.\n");
+        *return_val = 1;
+        return true;
+    }
+    if (args_path != NULL && use_zygote) {
+        fprintf(stderr, "--args-from can't be combined with --zygote.\n");
+        *return_val = 1;
+        return true;
+    }
+    if (args_path != NULL && strcmp(args_path, "-") == 0 && hosts_path != NULL) {
+        fprintf(stderr, "--hosts workers can't read --args-from standard input.\n");
+        *return_val = 1;
+        return true;
+    }
+
+    if (only_changed && output_path != NULL) {
+        fprintf(stderr, "Only one of --output and --changed may be given.\n");
+        *return_val = 1;
+        return true;
+    }
+
+    if (hosts_path != NULL) {
+        if (worker) {
+            fprintf(stderr, "Only one of --hosts and --worker may be given.\n");
+            *return_val = 1;
+            return true;
+        }
+        if (control_path != NULL || trace_path != NULL) {
+            fprintf(stderr, "--hosts can't be combined with --control or --trace.\n");
+            *return_val = 1;
+            return true;
+        }
+        if (record_path != NULL && record_format != RECORD_JSONL) {
+            fprintf(stderr, "--hosts can only --record in jsonl format.\n");
+            *return_val = 1;
+            return true;
+        }
+        // Workers get the same options and command, parsed the same
+        // way on the other end.
+        int n = 0;
+        worker_argv = calloc(argc + 2, sizeof(char *));
+        worker_argv[n++] = "repeat";
+        worker_argv[n++] = "--worker";
+        for (int i = 1; i < argc; i++) {
+            if (!local_arg[i]) {
+                worker_argv[n++] = argv[i];
+            }
+        }
+    }
+    if (worker && record_path != NULL) {
+        fprintf(stderr, "--worker can't be combined with --record.\n");
+        *return_val = 1;
+        return true;
+    }
+
     int arg_count = argc - optind;
     if (arg_count == 0) {
         fprintf(stderr, "%s\n", USAGE);
@@ -150,137 +772,1530 @@ parse_arguments(int argc, char *argv[], int *return_val) {
         return true;
     }
 
-    cmd_arg_idx = optind;
-    if (!use_exec) {
+    if (state_path != NULL && (hosts_path != NULL || worker || args_path != NULL)) {
+        fprintf(stderr, "--state can't be combined with --hosts or --args-from.\n");
+        *return_val = 1;
+        return true;
+    }
+    // A --state file only carries on the same command
+    struct xxh64 h;
+    xxh64_init(&h, 0);
+    for (int i = optind; i < argc; i++) {
+        xxh64_update(&h, argv[i], strlen(argv[i]) + 1);
+    }
+    if (compare_command != NULL) {
+        xxh64_update(&h, compare_command, strlen(compare_command) + 1);
+    }
+    command_hash = xxh64_digest(&h);
+
+    cmd_argv = argv + optind;
+    cmd_file = cmd_argv[0];
+    if (use_zygote) {
+        // The command is run once, directly, and serves every
+        // invocation through the same protocol as the coprocess shell.
+        use_coproc = true;
+    } else if (!use_exec) {
         // To use the shell, join the arguments together, separated by
         // spaces
-        size_t *strlens = calloc(argc, sizeof(size_t));
-        int total_len = arg_count - 1;  // start with spaces required
+        size_t total_len = arg_count - 1;  // start with spaces required
         for (int i = optind; i < argc; i++) {
-            strlens[i] = strlen(argv[i]);
-            total_len += strlens[i];
+            total_len += strlen(argv[i]);
         }
-        command = calloc(total_len + 1, 1);
+        command = malloc(total_len + 1);
         char *write_pt = command;
-        strcpy(write_pt, argv[optind]);
-        write_pt += strlens[optind];
-        for (int i = optind + 1; i < argc; i++) {
-            *write_pt++ = ' ';
-            strcpy(write_pt, argv[i]);
-            write_pt += strlens[i];
+        for (int i = optind; i < argc; i++) {
+            if (i > optind) {
+                *write_pt++ = ' ';
+            }
+            write_pt = stpcpy(write_pt, argv[i]);
         }
 
-        free(strlens);
+        // Most commands are just words, which we can run without a
+        // shell.  The rest go to a shell which outlives each run.
+        if (shell_needed(command)) {
+            shell_argv[2] = command;
+            cmd_argv = shell_argv;
+            cmd_file = "/bin/sh";
+            use_coproc = true;
+        } else {
+            cmd_argv = shell_split(command);
+            cmd_file = cmd_argv[0];
+        }
+    }
+    // The coprocess passes each invocation's arguments to the shell
+    // command as its positional parameters.
+    if (args_path != NULL && use_coproc) {
+        command = args_command(command);
+    }
+    // Both commands being compared are started the same way, so a
+    // shell command runs in an sh -c of its own: the coprocess only
+    // knows one command.
+    if (compare_command != NULL) {
+        if (use_zygote || args_path != NULL || use_prefork || caching || watching ||
+            hosts_path != NULL || worker) {
+            fprintf(stderr, "--compare can't be combined with --zygote, --args-from, --prefork,\n"
+                    "--cache, --watch or --hosts.\n");
+            *return_val = 1;
+            return true;
+        }
+        use_coproc = false;
+        if (!use_exec && shell_needed(compare_command)) {
+            compare_shell_argv[2] = compare_command;
+            compare_argv = compare_shell_argv;
+            compare_file = "/bin/sh";
+        } else {
+            compare_argv = shell_split(compare_command);
+            compare_file = compare_argv[0];
+        }
+        if (compare_file == NULL) {
+            fprintf(stderr, "--compare needs a command.\n");
+            *return_val = 1;
+            return true;
+        }
+        if (stats_format == STATS_NONE) {
+            stats_format = STATS_TEXT;
+        }
+    }
+    // Only a command started directly can be forked ahead of time,
+    // and only once its arguments are known.
+    if (use_prefork && (use_coproc || args_path != NULL)) {
+        fprintf(stderr, "--prefork needs a command run without a shell, and without\n"
+                "--args-from or --zygote.\n");
+        *return_val = 1;
+        return true;
     }
 
     return false;
 }
 
-// I bet there's a subtle overflow bug somewhere here
-static inline struct timespec
-timespec_add(const struct timespec * restrict a, const struct timespec * restrict b) {
-    uint32_t nsecs = (a->tv_nsec % NS_IN_SEC) + (b->tv_nsec % NS_IN_SEC);
-    struct timespec result = {
-        a->tv_sec + b->tv_sec + (a->tv_nsec / NS_IN_SEC) + (b->tv_nsec / NS_IN_SEC) + (nsecs / NS_IN_SEC),
-        nsecs % NS_IN_SEC
-    };
+bool
+parse_arguments(int argc, char *argv[], int *return_val) {
+    bool *local_arg = calloc(argc, sizeof(bool));
 
-    return result;
+    if (local_arg == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        *return_val = 1;
+        return true;
+    }
+    bool exit_now = parse_options(argc, argv, return_val, local_arg);
+    free(local_arg);
+    return exit_now;
 }
 
-int
-main(int argc, char *argv[])
-{
-    int exit_val = 0;
-    bool exit_now = parse_arguments(argc, argv, &exit_val);
-    struct timespec next_exec;
-
-    if (exit_now) {
-        return exit_val;
+static void
+get_time(struct timespec *ts) {
+    if (clock_gettime(CLOCK_MONOTONIC, ts) < 0) {
+        fprintf(stderr, "Fatal error getting time: %s\n", strerror(errno));
+        exit(1);
     }
+}
 
-    if (debug) {
-        printf("times = %d\n", times);
-        printf("interval_ts = { %ld, %ld }\n", interval_ts.tv_sec, interval_ts.tv_nsec);
-        printf("precise = %s\n", (precise) ? "true":"false");
-        printf("exit_on_error = %s\n", (exit_on_error) ? "true":"false");
-        printf("exit_on_success = %s\n", (exit_on_success) ? "true":"false");
-        printf("use_exec = %s\n", (use_exec) ? "true":"false");
-        fflush(stdout);
-    }
+// A slot in the pool of concurrently running invocations.  With the
+// default of one job, there is exactly one slot and the loop behaves
+// like a plain run-wait-sleep cycle.
+struct run {
+    pid_t pid;                  // 0 when the slot is idle
+    struct timespec ready_at;   // earliest launch time when not precise
+    struct timespec start;      // when the current invocation started
+    struct timespec scheduled;  // when it should have started, if precise
+    struct shell_coproc shell;  // runs the command when use_coproc
+    uint64_t iteration;         // 1 for the first invocation, and so on
+    int out_pipe[2];            // carries output to the log, or -1
+    struct capture capture;     // output being compared, with --changed
+    pid_t watch_pid;            // the child or coprocess being watched
+    int pidfd;                  // for watch_pid, or -1 without pidfds
+    cpu_set_t cpus;             // where its invocations run, with --cpus
+    struct cgroup_leaf cgroup;  // what its invocations run in, with --cgroup
+    struct timespec deadline;   // when --timeout next acts on this run
+    int kill_signal;            // last signal sent by --timeout, or 0
+    uint64_t fingerprint;       // of the --cache inputs when it started
+    pid_t ready_pid;            // a --prefork child waiting to start, or 0
+    int release_fd;             // starts ready_pid
+    int variant;                // which --compare command it runs, 0 or 1
+    bool ticked;                // it was launched for a tick of the schedule
+    struct timespec tick;       // which was this
+    int64_t late_ns;            // how late the launch was for it
+    int stamp_pipe[2];          // when its command was exec'd, if precise
+};
 
-    if (precise) {
-        int err = clock_gettime(CLOCK_MONOTONIC, &next_exec);
-        if (err < 0) {
-            fprintf(stderr, "Fatal error getting time: %s\n", strerror(errno));
-            exit(1);
-        }
-    }
+// Event sources the main loop adds to the event loop, besides its
+// timer and signals.  The tag index is the pool slot.
+enum {
+    SRC_CHILD = EV_USER,        // pidfd of a child or coprocess
+    SRC_STATUS,                 // status pipe of a coprocess
+    SRC_OUTPUT,                 // output pipe of a slot
+    SRC_WATCH,                  // inotify descriptor for --watch
+    SRC_CONTROL,                // --control socket and its clients
+    SRC_HOST,                   // records from a --hosts worker
+    SRC_COORDINATOR,            // a worker's stdin, which closes to stop it
+    SRC_ARGS,                   // --args-from input
+};
 
-    while (true) {
-        int ret;
+static struct run *pool = NULL;
+static int pool_size = 0;       // slots allocated, of which jobs are used
+static int running = 0;
+static bool stopping = false;
+static bool decided = false;
+// Stopped by SIGINT, SIGQUIT or SIGTERM rather than running to the end
+static bool interrupted = false;
+static bool have_pidfd = true;
+static uint64_t launched = 0;
+// With --watch, whether something has changed since the last launch,
+// and when the changes will have settled.
+static bool triggered = false;
+static struct timespec trigger_at;
+// Set by the pause command on the --control socket
+static bool paused = false;
+static struct timespec paused_at;
+static struct timespec next_exec = { 0, 0 };
+// A worker's own copy of its stdin, from the coordinator
+static int coordinator_fd = -1;
 
-        if (precise) {
-            next_exec = timespec_add(&next_exec, &interval_ts);
-        }
-        if (use_exec) {
-            pid_t child_pid = fork();
-            if (child_pid == 0) {
-                execvp(argv[cmd_arg_idx], argv + cmd_arg_idx);
-                exit(1);
-            }
-            while (true) {
-                pid_t err = wait(&ret);
-                if (err == -1) {
-                    if (errno != EINTR) {
-                        fprintf(stderr, "Fatal error waiting on child: %s\n", strerror(errno));
-                        exit(1);
-                    }
-                } else {
-                    break;
-                }
-            }
-        } else {
-            ret = system(command);
-        }
+// Applies the stop conditions to the exit status of a finished
+// invocation.  Returns true if no further invocations should be
+// started, setting *exit_val to the value repeat should exit with.
+// A run stopped by --timeout counts as an error with status 124, like
+// timeout(1), whatever signal finally ended it.
+static bool
+check_status(int status, bool timed_out, int *exit_val) {
+    if (timed_out) {
+        *exit_val = 124;
+        return exit_on_error;
+    }
+    *exit_val = WEXITSTATUS(status);
+    if (WEXITSTATUS(status) != 0 && exit_on_error) {
+        return true;
+    }
+    if (WEXITSTATUS(status) == 0 && exit_on_success) {
+        return true;
+    }
+    if (WIFSIGNALED(status) &&
+        (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGQUIT)) {
+        *exit_val = 0;
+        return true;
+    }
+    return false;
+}
 
-        if (ret < 0) {
-            fprintf(stderr, "Couldn't run command: %s\n", strerror(errno));
-            return 1;
+// Whether the mean run time is known as closely as --until-stable
+// asks.  A handful of runs can agree by chance, so it takes at least
+// STABLE_MIN_RUNS.
+#define STABLE_MIN_RUNS 10
+
+static bool
+stable_enough(void) {
+    double mean, half_width;
+
+    return until_stable > 0 && stats.estimate.n >= STABLE_MIN_RUNS &&
+           stats_interval(&mean, &half_width) && half_width <= mean * until_stable / 100;
+}
+
+// Returns the delay before the next invocation.  With --backoff, it
+// grows on each call from --interval up to --max-interval, and is then
+// picked at random between half and all of that, so that copies of
+// repeat started together on many hosts drift apart.
+static struct timespec
+next_interval(void) {
+    static int64_t current = 0;
+    int64_t base = timespec_to_ns(&interval_ts);
+    int64_t limit = timespec_to_ns(&max_interval_ts);
+
+    if (backoff == BACKOFF_NONE) {
+        return interval_ts;
+    }
+    if (current == 0) {
+        current = base;
+    } else if (backoff == BACKOFF_EXPONENTIAL) {
+        current = (current > INT64_MAX / 2) ? INT64_MAX : current * 2;
+    } else {
+        current = (current > INT64_MAX - base) ? INT64_MAX : current + base;
+    }
+    if (limit > 0 && current > limit) {
+        current = limit;
+    }
+    uint64_t half = (uint64_t)current / 2;
+    uint64_t r = ((uint64_t)random() << 31) ^ (uint64_t)random();
+    return timespec_from_ns(current - (int64_t)half + (int64_t)(r % (half + 1)));
+}
+
+// Moves the precise schedule on from the tick which was launched at
+// now, applying the catchup policy if that was late.  A tick counts as
+// missed when it could not start within one interval of its time.
+// Returns false if there is no schedule, or else sets *late_ns to how
+// late the launch was, which is only recorded once the run finishes, so
+// that a --state saved while it's still running doesn't count it.
+static bool
+advance_schedule(struct timespec *next_exec, const struct timespec *now, int64_t *late_ns) {
+    struct timespec step = next_interval();
+    int64_t interval_ns = timespec_to_ns(&step);
+    struct timespec late_ts = timespec_sub(now, next_exec);
+    int64_t behind;
+
+    if (interval_ns == 0) {
+        return false;
+    }
+    *late_ns = timespec_to_ns(&late_ts);
+    behind = *late_ns / interval_ns;
+    switch (catchup) {
+    case CATCHUP_BURST:
+        stats_record_missed((behind > 0) ? 1 : 0);
+        *next_exec = timespec_add(next_exec, &step);
+        break;
+    case CATCHUP_SKIP:
+        stats_record_missed(behind);
+        late_ts = timespec_from_ns((behind + 1) * interval_ns);
+        *next_exec = timespec_add(next_exec, &late_ts);
+        break;
+    case CATCHUP_SHIFT:
+        stats_record_missed(behind);
+        *next_exec = timespec_add(now, &step);
+        break;
+    }
+    return true;
+}
+
+// With --catchup=skip, moves a tick which can no longer start within
+// an interval of its time on to the first tick at or after now, so
+// that the launch waits for it rather than starting late.  With
+// --backoff there is no fixed grid to stay on, so this does nothing.
+static void
+skip_missed(struct timespec *next_exec, const struct timespec *now) {
+    int64_t interval_ns = timespec_to_ns(&interval_ts);
+    struct timespec late_ts = timespec_sub(now, next_exec);
+    int64_t late_ns = timespec_to_ns(&late_ts);
+
+    if (backoff != BACKOFF_NONE || interval_ns == 0 || late_ns < interval_ns) {
+        return;
+    }
+    int64_t missed = late_ns / interval_ns + ((late_ns % interval_ns) ? 1 : 0);
+    struct timespec skip = timespec_from_ns(missed * interval_ns);
+    *next_exec = timespec_add(next_exec, &skip);
+    stats_record_missed(missed);
+}
+
+// Marks a slot idle after its invocation finished with the given
+// status and resource usage, which is NULL if unknown, and applies
+// the stop conditions.
+static void
+finish_run(struct run *r, int status, const struct rusage *usage, int *exit_val) {
+    struct timespec noticed, now;
+
+    if (tracing) {
+        get_time(&noticed);
+        trace_event(TRACE_RUN, r - pool, &r->start, &noticed, r->iteration);
+    }
+
+    int changed = 0;
+    if (output_path != NULL && !output_copy(r->out_pipe[0], r->iteration, true)) {
+        fprintf(stderr, "Fatal error writing output: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (only_changed) {
+        if (!capture_read(&r->capture, r->out_pipe[0], true) ||
+            (changed = capture_finish(&r->capture)) < 0) {
+            fprintf(stderr, "Fatal error capturing output: %s\n", strerror(errno));
+            exit(1);
         }
-        if (WEXITSTATUS(ret) != 0 && exit_on_error) {
-            return WEXITSTATUS(ret);
+    }
+    r->pid = 0;
+    running--;
+    struct timespec exec_at;
+    bool stamped = r->stamp_pipe[0] >= 0 &&
+                   read(r->stamp_pipe[0], &exec_at, sizeof(exec_at)) == sizeof(exec_at);
+    if (r->ticked) {
+        if (stamped) {
+            struct timespec late = timespec_sub(&exec_at, &r->tick);
+            r->late_ns = timespec_to_ns(&late);
         }
-        if (WEXITSTATUS(ret) == 0 && exit_on_success) {
-            return 0;
+        stats_record_lateness(r->late_ns);
+        r->ticked = false;
+    }
+    get_time(&now);
+    // Timing from the intended start means a slow run that delays its
+    // successors is charged for that delay too.
+    const struct timespec *from = (rate > 0) ? &r->scheduled : &r->start;
+    if (stats_record(from, &now, status, r->kill_signal != 0) && compare_command != NULL) {
+        stats_record_variant(r->variant, from, &now, status, r->kill_signal != 0);
+    }
+    if (cgroup_path != NULL) {
+        int64_t peak, cpu_us;
+        cgroup_leaf_end(&r->cgroup, &peak, &cpu_us);
+        stats_record_cgroup(peak, cpu_us);
+    }
+    if ((record_path != NULL || worker) &&
+        !record_add(r->iteration, &r->scheduled, &r->start, &now, status,
+                    r->kill_signal != 0, usage)) {
+        fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+        exit(1);
+    }
+    // Only a result the command chose to give is worth reusing
+    if (caching && r->kill_signal == 0 && WIFEXITED(status)) {
+        cache_store(r->fingerprint, status);
+    }
+    if (!precise) {
+        struct timespec step = next_interval();
+        r->ready_at = timespec_add(&now, &step);
+    }
+    if (!decided && check_status(status, r->kill_signal != 0, exit_val)) {
+        decided = true;
+        stopping = true;
+    }
+    if (!decided && changed && exit_on_change) {
+        *exit_val = 0;
+        decided = true;
+        stopping = true;
+    }
+    if (!decided && stable_enough()) {
+        decided = true;
+        stopping = true;
+    }
+    if (tracing) {
+        get_time(&now);
+        trace_event(TRACE_REAP, r - pool, &noticed, &now, status);
+    }
+}
+
+// Answers an invocation in an idle slot with the last result, if the
+// --cache inputs are as they were when that run started.  Returns
+// false if the command needs to run, with the inputs' state noted for
+// the run.
+static bool
+reuse_result(struct run *r, const struct timespec *now, int *exit_val) {
+    int status;
+
+    r->fingerprint = cache_fingerprint();
+    if (!cache_lookup(r->fingerprint, &status)) {
+        return false;
+    }
+    launched++;
+    stats_record_cached();
+    if (!precise) {
+        struct timespec step = next_interval();
+        r->ready_at = timespec_add(now, &step);
+    }
+    if (!decided && check_status(status, false, exit_val)) {
+        decided = true;
+        stopping = true;
+    }
+    return true;
+}
+
+static int
+open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Starts watching the process that runs a slot's invocations, with a
+// pidfd where the kernel has them.  Without pidfds, SIGCHLD makes the
+// loop check every watched process instead.
+static void
+watch_process(struct run *r, pid_t pid, int idx) {
+    if (r->watch_pid == pid) {
+        return;
+    }
+    if (r->pidfd >= 0) {
+        ev_del(r->pidfd);
+        close(r->pidfd);
+        r->pidfd = -1;
+    }
+    r->watch_pid = pid;
+    if (have_pidfd) {
+        r->pidfd = open_pidfd(pid);
+        if (r->pidfd < 0 || !ev_add(r->pidfd, EV_TAG(SRC_CHILD, idx))) {
+            have_pidfd = false;
+        }
+    }
+}
+
+// Sets up where the children of slot idx send their output, filling in
+// dups with what to install in them.  Returns how many there are, or
+// -1 on an error.
+static int
+output_dups(int idx, struct launch_dup dups[2]) {
+    struct run *r = &pool[idx];
+
+    // Each slot keeps one output pipe for all its runs, with the
+    // parent holding the write end so it never sees EOF.
+    bool capturing = output_path != NULL || only_changed;
+    if (capturing && r->out_pipe[0] < 0) {
+        if (pipe2(r->out_pipe, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        fcntl(r->out_pipe[0], F_SETFL, O_NONBLOCK);
+        ev_add(r->out_pipe[0], EV_TAG(SRC_OUTPUT, idx));
+    }
+    dups[0] = (struct launch_dup){ r->out_pipe[1], 1 };
+    dups[1] = (struct launch_dup){ r->out_pipe[1], 2 };
+    // --changed only compares stdout, leaving stderr alone.
+    return (output_path != NULL) ? 2 : (only_changed) ? 1 : 0;
+}
+
+// With --prefork, forks the next child of an idle slot ahead of its
+// launch time, so that only releasing it is left for then.
+static bool
+prepare_run(int idx) {
+    struct run *r = &pool[idx];
+    struct launch_dup dups[2];
+    int ndups = output_dups(idx, dups);
+
+    if (ndups < 0) {
+        return false;
+    }
+    if (use_cpus) {
+        launch_set_cpus(&r->cpus);
+    }
+    if (cgroup_path != NULL) {
+        launch_set_cgroup(r->cgroup.dir_fd);
+    }
+    launch_set_stamp(r->stamp_pipe[1]);
+    r->ready_pid = launch_prepare(cmd_file, cmd_argv, dups, ndups, &r->release_fd);
+    if (r->ready_pid < 0) {
+        r->ready_pid = 0;
+        return false;
+    }
+    return true;
+}
+
+// Gets rid of prepared children which will never be needed.
+static void
+cancel_prepared(void) {
+    for (int i = 0; i < pool_size; i++) {
+        if (pool[i].ready_pid != 0) {
+            kill(pool[i].ready_pid, SIGKILL);
+            close(pool[i].release_fd);
+            waitpid(pool[i].ready_pid, NULL, 0);
+            pool[i].ready_pid = 0;
         }
+    }
+}
+
+// How often --state is saved while anything is changing
+static const struct timespec state_interval_ts = { 1, 0 };
+
+// Fills in what --state keeps of the loop.  Invocations still running
+// are lost should repeat die, so they're left to run again.
+static void
+fill_state(struct state_loop *loop) {
+    loop->times = times + ((loop->limited) ? running : 0);
+    loop->launched = launched - running;
+    loop->have_schedule = precise;
+    loop->next_exec = next_exec;
+}
+
+// Picks which command --compare runs next, 0 for the main one.  Each
+// pair of invocations runs both, so that neither gets ahead, and with
+// --order=random which goes first is picked afresh for each pair.
+static int
+next_variant(void) {
+    static int first = 0;
+
+    if (launched % 2 == 0) {
+        first = (compare_order == ORDER_RANDOM) ? (random() & 1) : 0;
+        return first;
+    }
+    return !first;
+}
+
+// Starts the next invocation in an idle slot, with the nwords lines
+// last taken from --args-from.  Returns false if it couldn't be
+// started.
+static bool
+start_run(int idx, const struct timespec *launch_at, int nwords) {
+    struct run *r = &pool[idx];
+    struct launch_dup dups[2];
+    int ndups = output_dups(idx, dups);
 
-        if (WIFSIGNALED(ret) &&
-            (WTERMSIG(ret) == SIGINT || WTERMSIG(ret) == SIGQUIT)) {
-            return 0;
+    if (ndups < 0) {
+        return false;
+    }
+    if (use_cpus) {
+        launch_set_cpus(&r->cpus);
+    }
+    if (cgroup_path != NULL) {
+        cgroup_leaf_begin(&r->cgroup);
+        launch_set_cgroup(r->cgroup.dir_fd);
+    }
+    launch_set_stamp(r->stamp_pipe[1]);
+    r->scheduled = *launch_at;
+    get_time(&r->start);
+    if (use_coproc) {
+        pid_t old_pid = r->shell.pid;
+        const char *request = (args_path != NULL) ? args_request(nwords) : NULL;
+        if (args_path != NULL && request == NULL) {
+            return false;
+        }
+        bool ok = (use_zygote)
+            ? shell_zygote_run(&r->shell, cmd_file, cmd_argv, r->out_pipe[1], ndups)
+            : shell_coproc_run(&r->shell, command, request, r->out_pipe[1], ndups);
+        if (!ok) {
+            return false;
+        }
+        if (r->shell.pid != old_pid) {
+            ev_add(r->shell.status_fd, EV_TAG(SRC_STATUS, idx));
+        }
+        r->pid = r->shell.pid;
+    } else if (args_path != NULL) {
+        char **argv = args_apply(nwords);
+        if (argv == NULL) {
+            return false;
+        }
+        r->pid = launch_command(argv[0], argv, dups, ndups);
+        if (r->pid < 0) {
+            r->pid = 0;
+            return false;
+        }
+    } else {
+        r->pid = 0;
+        if (r->ready_pid != 0) {
+            pid_t pid = r->ready_pid;
+            r->ready_pid = 0;
+            if (launch_release(r->release_fd)) {
+                r->pid = pid;
+            } else {
+                // It died while waiting, so start one the usual way
+                waitpid(pid, NULL, 0);
+            }
         }
+        if (r->pid == 0 && compare_command != NULL) {
+            r->variant = next_variant();
+            r->pid = (r->variant == 0) ? launch_command(cmd_file, cmd_argv, dups, ndups)
+                                       : launch_command(compare_file, compare_argv, dups, ndups);
+        } else if (r->pid == 0) {
+            r->pid = launch_command(cmd_file, cmd_argv, dups, ndups);
+        }
+        if (r->pid < 0) {
+            r->pid = 0;
+            return false;
+        }
+    }
+    watch_process(r, r->pid, idx);
+    r->kill_signal = 0;
+    if (use_timeout) {
+        r->deadline = timespec_add(&r->start, &timeout_ts);
+    }
+    running++;
+    launched++;
+    r->iteration = launched;
+    if (tracing) {
+        struct timespec now;
+        get_time(&now);
+        trace_event(TRACE_LAUNCH, idx, &r->start, &now, r->iteration);
+    }
+    return true;
+}
+
+// Reaps the process watched by a slot if it has exited.  A coprocess
+// exiting mid-run takes the run with it.
+static void
+reap_slot(struct run *r, int *exit_val) {
+    struct rusage usage;
+    int status;
 
-        if (times > 0) {
-            times--;
-            if (times == 0) {
-                return WEXITSTATUS(ret);
+    if (r->watch_pid == 0) {
+        return;
+    }
+    pid_t err = wait4(r->watch_pid, &status, WNOHANG, &usage);
+    if (err == 0) {
+        return;
+    }
+    if (err == -1) {
+        fprintf(stderr, "Fatal error waiting on child: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (r->pidfd >= 0) {
+        ev_del(r->pidfd);
+        close(r->pidfd);
+        r->pidfd = -1;
+    }
+    r->watch_pid = 0;
+    if (use_coproc) {
+        ev_del(r->shell.status_fd);
+        shell_coproc_reaped(&r->shell);
+    }
+    // A coprocess's usage covers all the runs it served
+    if (r->pid != 0) {
+        finish_run(r, status, (use_coproc) ? NULL : &usage, exit_val);
+    }
+}
+
+// Sends a signal to everything a run started.  Children lead their
+// own process groups whenever --timeout is in use.  A coprocess is
+// signalled along with its subshell, and is replaced on the next run.
+static void
+signal_run(struct run *r, int sig) {
+    if (use_timeout) {
+        kill(-r->pid, sig);
+    } else {
+        kill(r->pid, sig);
+    }
+}
+
+// Escalates from SIGTERM to SIGKILL on runs which have outlived
+// --timeout, and brings *wake forward to the next deadline.
+static void
+check_timeouts(const struct timespec *now, struct timespec *wake, bool *have_wake) {
+    for (int i = 0; i < pool_size; i++) {
+        struct run *r = &pool[i];
+
+        if (r->pid == 0 || r->kill_signal == SIGKILL) {
+            continue;
+        }
+        if (timespec_cmp(&r->deadline, now) <= 0) {
+            r->kill_signal = (r->kill_signal == 0) ? SIGTERM : SIGKILL;
+            signal_run(r, r->kill_signal);
+            r->deadline = timespec_add(now, &kill_after_ts);
+            if (r->kill_signal == SIGKILL) {
+                continue;
             }
         }
+        if (!*have_wake || timespec_cmp(&r->deadline, wake) < 0) {
+            *wake = r->deadline;
+            *have_wake = true;
+        }
+    }
+}
 
-        if (interval_ts.tv_sec || interval_ts.tv_nsec) {
-            int err;
-            if (!precise) {
-                err = clock_gettime(CLOCK_MONOTONIC, &next_exec);
-                if (err < 0) {
-                    fprintf(stderr, "Fatal error getting time: %s\n", strerror(errno));
-                    exit(1);
+// Binds memory to the --numa-node, whose CPUs are used unless --cpus
+// gave others.  Every child inherits the memory policy.
+static bool
+place_numa(void) {
+    if (!affinity_bind_node(numa_node)) {
+        fprintf(stderr, "Couldn't bind memory to NUMA node %d: %s\n",
+                numa_node, strerror(errno));
+        return false;
+    }
+    if (!use_cpus) {
+        if (!affinity_node_cpus(numa_node, &cpu_list)) {
+            fprintf(stderr, "Couldn't find the CPUs of NUMA node %d: %s\n",
+                    numa_node, strerror(errno));
+            return false;
+        }
+        use_cpus = CPU_COUNT(&cpu_list) > 0;
+    }
+    return true;
+}
+
+// Makes repeat itself as punctual as the kernel allows, for --realtime
+// and --timer-slack.  Children go back to the normal scheduler when
+// they are created, and don't inherit the locked memory, but do keep
+// the timer slack.
+static bool
+place_realtime(void) {
+    // The kernel's least slack is 1ns; 0 would mean the default
+    int64_t slack = timespec_to_ns(&timer_slack_ts);
+    if ((timer_slack_given || realtime_priority > 0) &&
+        prctl(PR_SET_TIMERSLACK, (unsigned long)((slack > 0) ? slack : 1), 0, 0, 0) < 0) {
+        fprintf(stderr, "Couldn't set timer slack: %s\n", strerror(errno));
+        return false;
+    }
+    if (realtime_priority == 0) {
+        return true;
+    }
+    struct sched_param param = { .sched_priority = realtime_priority };
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0) {
+        fprintf(stderr, "Couldn't use realtime scheduling: %s\n", strerror(errno));
+        return false;
+    }
+    // Page faults would undo the rest
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Couldn't lock memory: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// With --spin, waits for a launch time less than the spin away by
+// polling the clock, which wakes closer to it than a timer can, and
+// updates now.  Returns false if the time is further off than that.
+static bool
+spin_until(const struct timespec *when, struct timespec *now) {
+    struct timespec left = timespec_sub(when, now);
+
+    if (timespec_cmp(&left, &spin_ts) > 0) {
+        return false;
+    }
+    do {
+        get_time(now);
+    } while (timespec_cmp(when, now) > 0);
+    return true;
+}
+
+static bool
+check_cpus(void) {
+    cpu_set_t allowed, both;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    CPU_AND(&both, &cpu_list, &allowed);
+    if (!CPU_EQUAL(&both, &cpu_list)) {
+        fprintf(stderr, "Some of the CPUs given aren't available.\n");
+        return false;
+    }
+    return true;
+}
+
+// Gives a slot its CPUs.  A single job may use every CPU listed, while
+// several are dealt one CPU each in turn, so that each keeps its
+// caches warm and none of them is moved about by the scheduler.
+static void
+place_slot(int idx) {
+    struct run *r = &pool[idx];
+    int nth = idx % CPU_COUNT(&cpu_list);
+
+    if (jobs == 1) {
+        r->cpus = cpu_list;
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpu_list) && nth-- == 0) {
+            CPU_ZERO(&r->cpus);
+            CPU_SET(cpu, &r->cpus);
+            return;
+        }
+    }
+}
+
+// Removes the cgroup leaves once coprocesses, the only things left in
+// them when repeat is done, have exited.
+static void
+remove_cgroups(void) {
+    for (int i = 0; i < pool_size; i++) {
+        struct run *r = &pool[i];
+        if (use_coproc && r->shell.pid != 0) {
+            close(r->shell.request_fd);
+            waitpid(r->shell.pid, NULL, 0);
+        }
+        cgroup_leaf_remove(&r->cgroup);
+    }
+}
+
+// Adds slots to the pool until it has size of them, each ready to run
+// at now.  Returns false, having said why, if one couldn't be set up.
+static bool
+grow_pool(int size, const struct timespec *now) {
+    struct run *grown = realloc(pool, size * sizeof(struct run));
+
+    if (grown == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    pool = grown;
+    for (; pool_size < size; pool_size++) {
+        struct run *r = &pool[pool_size];
+        memset(r, 0, sizeof(*r));
+        r->out_pipe[0] = r->out_pipe[1] = -1;
+        r->capture.spool_fd = -1;
+        r->pidfd = -1;
+        r->release_fd = -1;
+        r->stamp_pipe[0] = r->stamp_pipe[1] = -1;
+        r->cgroup.dir_fd = r->cgroup.peak_fd = r->cgroup.stat_fd = -1;
+        r->ready_at = *now;
+        // Lateness is measured to the exec, which only the child sees
+        if (precise && !use_coproc && pipe2(r->stamp_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            fprintf(stderr, "Couldn't create pipe: %s\n", strerror(errno));
+            return false;
+        }
+        if (use_cpus) {
+            place_slot(pool_size);
+        }
+        if (cgroup_path != NULL && !cgroup_leaf_create(&r->cgroup, pool_size)) {
+            fprintf(stderr, "Couldn't create a cgroup under %s: %s\n", cgroup_path, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Carries out a command from the --control socket.
+static void
+control_command(char *line, FILE *reply) {
+    char *arg = line + strcspn(line, " ");
+    struct timespec now;
+
+    if (*arg != '\0') {
+        *arg++ = '\0';
+    }
+    get_time(&now);
+    if (strcmp(line, "metrics") == 0) {
+        stats_print_prometheus(reply);
+        fprintf(reply, "# HELP repeat_running Invocations running now.\n"
+                "# TYPE repeat_running gauge\nrepeat_running %d\n", running);
+        fprintf(reply, "# HELP repeat_jobs Invocations allowed to run at once.\n"
+                "# TYPE repeat_jobs gauge\nrepeat_jobs %d\n", jobs);
+        fprintf(reply, "# HELP repeat_paused Whether launching is paused.\n"
+                "# TYPE repeat_paused gauge\nrepeat_paused %d\n", paused);
+        fprintf(reply, "# HELP repeat_interval_seconds Time between invocations.\n"
+                "# TYPE repeat_interval_seconds gauge\nrepeat_interval_seconds %.9f\n",
+                timespec_to_ns(&interval_ts) / 1e9);
+        return;
+    } else if (strcmp(line, "stats") == 0) {
+        stats_print(reply, STATS_JSON);
+        return;
+    } else if (strcmp(line, "pause") == 0) {
+        if (!paused) {
+            paused = true;
+            paused_at = now;
+        }
+    } else if (strcmp(line, "resume") == 0) {
+        // The schedule carries on from where it was paused, rather
+        // than counting the pause as missed ticks.
+        if (paused) {
+            struct timespec gap = timespec_sub(&now, &paused_at);
+            next_exec = timespec_add(&next_exec, &gap);
+            paused = false;
+        }
+    } else if (strcmp(line, "interval") == 0) {
+        struct timespec ts;
+        if (rate > 0) {
+            fprintf(reply, "error: running at a --rate, so use rate\n");
+            return;
+        }
+        if (!parse_duration(arg, &ts)) {
+            fprintf(reply, "error: bad duration\n");
+            return;
+        }
+        interval_ts = ts;
+    } else if (strcmp(line, "rate") == 0) {
+        double value;
+        const char *err = (rate > 0) ? parse_rate(arg, &value) : "Not running at a --rate.";
+        if (err != NULL) {
+            fprintf(reply, "error: %s\n", err);
+            return;
+        }
+        rate = value;
+        interval_ts = rate_interval(rate);
+    } else if (strcmp(line, "jobs") == 0) {
+        char *endp;
+        long n = strtol(arg, &endp, 10);
+        if (endp == arg || *endp != '\0' || n < 1 || n > 65536) {
+            fprintf(reply, "error: number of jobs must be a positive integer\n");
+            return;
+        }
+        // Slots beyond the new number finish what they are running
+        int old_jobs = jobs;
+        jobs = n;
+        if (n > pool_size && !grow_pool(n, &now)) {
+            jobs = old_jobs;
+            fprintf(reply, "error: couldn't add jobs\n");
+            return;
+        }
+    } else {
+        fprintf(reply, "error: unknown command; try metrics, stats, pause, resume,\n"
+                "interval DURATION, rate NUM, or jobs NUM\n");
+        return;
+    }
+    fprintf(reply, "ok\n");
+}
+
+static void
+handle_event(uint64_t tag, int *exit_val) {
+    if (EV_KIND(tag) == SRC_CONTROL) {
+        control_event(EV_INDEX(tag));
+        return;
+    }
+    struct run *r = &pool[EV_INDEX(tag)];
+    int status, sig;
+
+    switch (EV_KIND(tag)) {
+    case EV_TIMER:
+        // The loop launches whatever is due each time around
+        break;
+    case EV_SIGNAL:
+        while ((sig = ev_next_signal()) != 0) {
+            switch (sig) {
+            case SIGCHLD:
+                for (int i = 0; i < pool_size && !have_pidfd; i++) {
+                    reap_slot(&pool[i], exit_val);
                 }
-                next_exec = timespec_add(&next_exec, &interval_ts);
+                break;
+            case SIGINT:
+            case SIGQUIT:
+            case SIGTERM:
+                // Children in their own process groups don't receive
+                // the terminal's signals, and none receive a SIGTERM
+                // sent to repeat alone, so pass them on.
+                for (int i = 0; i < pool_size; i++) {
+                    if (pool[i].pid != 0 && (use_timeout || sig == SIGTERM)) {
+                        signal_run(&pool[i], sig);
+                    }
+                }
+                // Stop once the running invocations exit, the same as
+                // when an invocation is interrupted.
+                interrupted = true;
+                if (!decided) {
+                    *exit_val = 0;
+                    decided = true;
+                    stopping = true;
+                }
+                break;
+            case SIGUSR1:
+                stats_print(stderr, (stats_format != STATS_NONE) ? stats_format : STATS_TEXT);
+                record_flush();
+                break;
             }
+        }
+        break;
+    case SRC_CHILD:
+        reap_slot(r, exit_val);
+        break;
+    case SRC_STATUS:
+        switch (shell_coproc_status(&r->shell, &status)) {
+        case 1:
+            finish_run(r, status, NULL, exit_val);
+            break;
+        case -1:
+            // The coprocess is exiting, and will be reaped
+            ev_del(r->shell.status_fd);
+            break;
+        }
+        break;
+    case SRC_COORDINATOR: {
+        // Nothing is sent this way; the end of it means stop
+        char buf[256];
+        ssize_t len = read(coordinator_fd, buf, sizeof(buf));
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+            ev_del(coordinator_fd);
+            close(coordinator_fd);
+            coordinator_fd = -1;
+            if (!decided) {
+                *exit_val = 0;
+                decided = true;
+            }
+            stopping = true;
+        }
+        break;
+    }
+    case SRC_ARGS:
+        args_event();
+        break;
+    case SRC_WATCH:
+        // Every change pushes the run back, so a burst of them only
+        // runs the command once.
+        if (watch_read()) {
+            get_time(&trigger_at);
+            trigger_at = timespec_add(&trigger_at, &debounce_ts);
+            triggered = true;
+        }
+        break;
+    case SRC_OUTPUT:
+        if (only_changed) {
+            if (!capture_read(&r->capture, r->out_pipe[0], false)) {
+                fprintf(stderr, "Fatal error capturing output: %s\n", strerror(errno));
+                exit(1);
+            }
+        } else if (!output_copy(r->out_pipe[0], r->iteration, false)) {
+            fprintf(stderr, "Fatal error writing output: %s\n", strerror(errno));
+            exit(1);
+        }
+        break;
+    }
+}
+
+// Sets up a worker for a --hosts run.  Records go to the coordinator
+// on stdout, so the command's output goes to stderr instead, and the
+// command gets no input, leaving stdin to say when to stop.
+static bool
+start_worker(void) {
+    int records_fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    coordinator_fd = fcntl(0, F_DUPFD_CLOEXEC, 3);
+    if (records_fd < 0 || null_fd < 0 || coordinator_fd < 0 ||
+        dup2(null_fd, 0) < 0 || dup2(2, 1) < 0) {
+        return false;
+    }
+    close(null_fd);
+    record_open_fd(records_fd);
+    return ev_add(coordinator_fd, EV_TAG(SRC_COORDINATOR, 0));
+}
+
+// Sends a worker's records on once the oldest has waited a batch
+// interval, or sets the timer for when it will have.
+static void
+send_records(const struct timespec *now, struct timespec *wake, bool *have_wake) {
+    struct timespec since;
+
+    if (!record_pending(&since)) {
+        return;
+    }
+    struct timespec due = timespec_add(&since, &worker_batch_ts);
+    if (timespec_cmp(&due, now) <= 0) {
+        if (!record_flush()) {
+            fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+            exit(1);
+        }
+    } else if (!*have_wake || timespec_cmp(&due, wake) < 0) {
+        *wake = due;
+        *have_wake = true;
+    }
+}
 
-            do {
-                err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_exec, NULL);
-            } while (err != 0);
+// Takes in a record which the worker on host idx sent, and applies
+// the stop conditions to it for every host.
+static void
+host_record(int idx, const char *line, int *exit_val) {
+    const char *duration = strstr(line, "\"duration_ns\":");
+    const char *code;
+    int status = 0;
+
+    // Anything else on stdout, such as --debug, isn't a record
+    if (line[0] != '{' || duration == NULL) {
+        return;
+    }
+    int64_t ns = strtoll(duration + 14, NULL, 10);
+    if ((code = strstr(line, "\"exit\":")) != NULL) {
+        status = W_EXITCODE(atoi(code + 7), 0);
+    } else if ((code = strstr(line, "\"signal\":")) != NULL) {
+        status = W_EXITCODE(0, atoi(code + 9));
+    }
+    bool timed_out = strstr(line, "\"timed_out\":true") != NULL;
+    if (rate > 0) {
+        // Charged from the scheduled start, as for a local run
+        const char *scheduled = strstr(line, "\"scheduled_ns\":");
+        const char *start = strstr(line, "\"start_ns\":");
+        if (scheduled != NULL && start != NULL) {
+            ns += strtoll(start + 11, NULL, 10) - strtoll(scheduled + 15, NULL, 10);
+        }
+    }
+    struct timespec zero = { 0, 0 };
+    struct timespec elapsed = timespec_from_ns(ns);
+    struct timespec now;
+    get_time(&now);
+    stats_record(&zero, &elapsed, status, timed_out);
+    if (record_path != NULL && !record_add_host(fanout_name(idx), line, &now)) {
+        fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (!decided && (check_status(status, timed_out, exit_val) || stable_enough())) {
+        decided = true;
+        fanout_stop();
+    }
+}
+
+// Runs a worker on every host in --hosts until they have all finished,
+// and reports on their invocations together.
+static int
+coordinate(void) {
+    int exit_val = 0;
+    bool lost = false;
+
+    if (!fanout_load(hosts_path)) {
+        fprintf(stderr, "Couldn't read %s: %s\n", hosts_path, strerror(errno));
+        return 1;
+    }
+    if (fanout_count() == 0) {
+        fprintf(stderr, "No hosts in %s.\n", hosts_path);
+        return 1;
+    }
+    if (record_path != NULL && !record_open(record_path, RECORD_JSONL, 0, false)) {
+        fprintf(stderr, "Couldn't open %s: %s\n", record_path, strerror(errno));
+        return 1;
+    }
+    stats_init();
+    stats.warmup = warmup_runs;
+    stats.estimating = until_stable > 0;
+    stats.comparing = compare_command != NULL;
+    if (!fanout_start(shell_split(ssh_command), worker_argv, SRC_HOST)) {
+        fprintf(stderr, "Couldn't start workers: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int remaining = fanout_count();
+    while (remaining > 0) {
+        uint64_t tags[64];
+        int ready = ev_wait(tags, 64);
+        if (ready < 0) {
+            fprintf(stderr, "Fatal error waiting: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < ready; i++) {
+            int idx = EV_INDEX(tags[i]);
+            int sig;
+            if (EV_KIND(tags[i]) == EV_SIGNAL) {
+                // ssh runs in its own process group, so the workers
+                // only hear of an interrupt through us.
+                while ((sig = ev_next_signal()) != 0) {
+                    if (sig == SIGINT || sig == SIGQUIT || sig == SIGTERM) {
+                        if (!decided) {
+                            exit_val = 0;
+                            decided = true;
+                        }
+                        fanout_stop();
+                    } else if (sig == SIGUSR1) {
+                        stats_print(stderr, (stats_format != STATS_NONE) ? stats_format : STATS_TEXT);
+                        record_flush();
+                    }
+                }
+                continue;
+            }
+            if (EV_KIND(tags[i]) != SRC_HOST) {
+                continue;
+            }
+            int more = fanout_read(idx);
+            char *line;
+            while ((line = fanout_line(idx)) != NULL) {
+                host_record(idx, line, &exit_val);
+            }
+            if (more > 0) {
+                continue;
+            }
+            int status = fanout_wait(idx);
+            remaining--;
+            // ssh exits with 255 when it can't reach the host
+            if (more < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 255) {
+                fprintf(stderr, "Lost the worker on %s.\n", fanout_name(idx));
+                lost = true;
+            }
+        }
+    }
+
+    if (stats_format != STATS_NONE) {
+        stats_print(stderr, stats_format);
+    }
+    if (!record_flush()) {
+        fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+        return 1;
+    }
+    return (lost && !decided) ? 255 : exit_val;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int exit_val = 0;
+    bool exit_now = parse_arguments(argc, argv, &exit_val);
+    struct timespec now;
+
+    if (exit_now) {
+        return exit_val;
+    }
+
+    if (debug) {
+        printf("times = %d\n", times);
+        printf("interval_ts = { %ld, %ld }\n", interval_ts.tv_sec, interval_ts.tv_nsec);
+        printf("precise = %s\n", (precise) ? "true":"false");
+        printf("catchup = %s\n", (const char *[]){ "burst", "skip", "shift" }[catchup]);
+        printf("backoff = %s\n", (const char *[]){ "none", "exponential", "linear" }[backoff]);
+        printf("max_interval_ts = { %ld, %ld }\n", max_interval_ts.tv_sec, max_interval_ts.tv_nsec);
+        printf("realtime_priority = %d\n", realtime_priority);
+        printf("spin = { %ld, %ld }\n", spin_ts.tv_sec, spin_ts.tv_nsec);
+        printf("exit_on_error = %s\n", (exit_on_error) ? "true":"false");
+        printf("exit_on_success = %s\n", (exit_on_success) ? "true":"false");
+        printf("until_stable = %g%%\n", until_stable);
+        printf("warmup = %" PRIu64 "\n", warmup_runs);
+        printf("use_exec = %s\n", (use_exec) ? "true":"false");
+        printf("jobs = %d\n", jobs);
+        printf("timeout = { %ld, %ld }\n", timeout_ts.tv_sec, timeout_ts.tv_nsec);
+        printf("rate = %g/s\n", rate);
+        printf("watching = %s\n", (watching) ? "true":"false");
+        printf("launcher = %s\n", launch_method_name());
+        printf("shell = %s\n", (use_zygote) ? "zygote" : (use_exec) ? "none" :
+               (use_coproc) ? "coprocess" : "direct");
+        fflush(stdout);
+    }
+
+    // The signals we act on are only received through the event
+    // loop.  A dead coprocess shows up as EPIPE rather than SIGPIPE.
+    sigset_t blocked, orig_mask;
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGQUIT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked, &orig_mask);
+    launch_init(&orig_mask, use_timeout || hosts_path != NULL);
+    if (!ev_init(&blocked)) {
+        fprintf(stderr, "Couldn't set up event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    if (debug) {
+        printf("event_loop = %s\n", ev_backend_name());
+        fflush(stdout);
+    }
+    if (hosts_path != NULL) {
+        return coordinate();
+    }
+    if (worker && !start_worker()) {
+        fprintf(stderr, "Couldn't set up worker: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (output_path != NULL && !output_open(output_path, output_size, output_keep)) {
+        fprintf(stderr, "Couldn't open %s: %s\n", output_path, strerror(errno));
+        return 1;
+    }
+    if (numa_node >= 0 && !place_numa()) {
+        return 1;
+    }
+    if (!place_realtime()) {
+        return 1;
+    }
+    if (use_cpus && !check_cpus()) {
+        return 1;
+    }
+    if (cgroup_path != NULL && !cgroup_init(cgroup_path, memory_max, cpu_max)) {
+        fprintf(stderr, "Couldn't set up cgroups under %s: %s\n", cgroup_path, strerror(errno));
+        return 1;
+    }
+    if (trace_path != NULL && !trace_open(trace_path)) {
+        fprintf(stderr, "Couldn't open %s: %s\n", trace_path, strerror(errno));
+        return 1;
+    }
+    if (control_path != NULL &&
+        !control_open(control_path, SRC_CONTROL, control_command)) {
+        fprintf(stderr, "Couldn't listen on %s: %s\n", control_path, strerror(errno));
+        return 1;
+    }
+    if (watching) {
+        int fd = watch_init();
+        if (fd < 0 || !ev_add(fd, EV_TAG(SRC_WATCH, 0))) {
+            fprintf(stderr, "Couldn't watch for changes: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (args_path != NULL && !(args_open(args_path, SRC_ARGS) &&
+                               (use_coproc || args_prepare(cmd_argv)))) {
+        fprintf(stderr, "Couldn't read %s: %s\n", args_path, strerror(errno));
+        return 1;
+    }
+    struct timespec started;
+
+    stats_init();
+    stats.warmup = warmup_runs;
+    stats.estimating = until_stable > 0;
+    stats.comparing = compare_command != NULL;
+    struct state_loop loop = { .limited = times > 0 };
+    bool resumed = false;
+    if (state_path != NULL) {
+        switch (state_open(state_path, command_hash, &loop)) {
+        case STATE_ERROR:
+            fprintf(stderr, "Couldn't open %s: %s\n", state_path, strerror(errno));
+            return 1;
+        case STATE_OTHER:
+            fprintf(stderr, "%s holds the state of some other command, or isn't a\n"
+                    "repeat state file.\n", state_path);
+            return 1;
+        case STATE_DAMAGED:
+            fprintf(stderr, "%s was cut short while being written, and holds no state\n"
+                    "to carry on from.\n", state_path);
+            return 1;
+        case STATE_NEW:
+            break;
+        case STATE_RESUMED:
+            if (loop.finished || (loop.limited && loop.times <= 0)) {
+                // Nothing is left to do but report what was done
+                if (stats_format != STATS_NONE) {
+                    stats_print(stderr, stats_format);
+                }
+                return loop.exit_val;
+            }
+            resumed = true;
+            if (loop.limited) {
+                times = loop.times;
+            }
+            loop.limited = times > 0;
+            launched = loop.launched;
+            // The rest of these are options rather than state
+            stats.estimating = until_stable > 0;
+            stats.comparing = compare_command != NULL;
+            if (debug) {
+                printf("resumed after %" PRIu64 " invocations\n", launched);
+            }
+            break;
+        }
+    }
+    // A resumed loop's records follow on from those before it
+    if (record_path != NULL &&
+        !record_open(record_path, record_format, record_ring_size, resumed)) {
+        fprintf(stderr, "Couldn't open %s: %s\n", record_path, strerror(errno));
+        return 1;
+    }
+    struct timespec state_due = { 0, 0 };
+    bool state_dirty = true;
+    get_time(&started);
+    srandom(getpid() ^ started.tv_nsec);
+    if (!grow_pool(jobs, &started)) {
+        if (cgroup_path != NULL) {
+            remove_cgroups();
+        }
+        return 1;
+    }
+    if (precise) {
+        // A resumed schedule keeps its ticks where they were
+        next_exec = (resumed && loop.have_schedule) ? loop.next_exec : started;
+    }
+    // The command runs once at the start, and then on each change
+    trigger_at = started;
+    triggered = true;
+
+    while (true) {
+        if (stopping && running == 0) {
+            if (stats_format != STATS_NONE) {
+                stats_print(stderr, stats_format);
+            }
+            if (!record_flush()) {
+                fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+                return 1;
+            }
+            cancel_prepared();
+            if (cgroup_path != NULL) {
+                remove_cgroups();
+            }
+            fill_state(&loop);
+            loop.finished = !interrupted;
+            loop.exit_val = exit_val;
+            if (!state_close(&loop)) {
+                fprintf(stderr, "Fatal error saving state: %s\n", strerror(errno));
+                return 1;
+            }
+            control_close();
+            if (!trace_close()) {
+                fprintf(stderr, "Fatal error writing trace: %s\n", strerror(errno));
+                return 1;
+            }
+            if (debug) {
+                // Reported so launchers can be compared against each
+                // other with a trivial command.
+                get_time(&now);
+                struct timespec elapsed = timespec_sub(&now, &started);
+                double secs = elapsed.tv_sec + (double)elapsed.tv_nsec / NS_IN_SEC;
+                printf("launched %" PRIu64 " invocations in %.3fs (%.0f/s)\n",
+                       launched, secs, (secs > 0) ? launched / secs : 0.0);
+                printf("%s made %" PRIu64 " system calls (%.2f per invocation)\n",
+                       ev_backend_name(), ev_syscalls(),
+                       (launched > 0) ? (double)ev_syscalls() / launched : 0.0);
+            }
+            return exit_val;
+        }
+
+        // Fill idle slots whose launch time has come, and set the
+        // timer for the earliest future launch time or deadline.
+        struct timespec wake = { 0, 0 };
+        bool have_wake = false;
+        get_time(&now);
+        for (int i = 0; i < jobs && !stopping && !paused; i++) {
+            if (pool[i].pid != 0) {
+                continue;
+            }
+            if (use_prefork && pool[i].ready_pid == 0 && !prepare_run(i)) {
+                fprintf(stderr, "Couldn't run command: %s\n", strerror(errno));
+                return 1;
+            }
+            if (precise && catchup == CATCHUP_SKIP) {
+                skip_missed(&next_exec, &now);
+            }
+            struct timespec *launch_at = (precise) ? &next_exec : &pool[i].ready_at;
+            if (watching) {
+                if (!triggered) {
+                    continue;
+                }
+                if (timespec_cmp(&trigger_at, launch_at) > 0) {
+                    launch_at = &trigger_at;
+                }
+            }
+            if (timespec_cmp(launch_at, &now) > 0 && !spin_until(launch_at, &now)) {
+                // Woken early enough to spin for the rest, with --spin
+                struct timespec early = timespec_sub(launch_at, &spin_ts);
+                if (!have_wake || timespec_cmp(&early, &wake) < 0) {
+                    wake = early;
+                    have_wake = true;
+                }
+                continue;
+            }
+            int nwords = 0;
+            if (args_path != NULL && (nwords = args_take(args_batch)) <= 0) {
+                // More input wakes the loop, and the end of it stops it
+                if (nwords < 0) {
+                    stopping = true;
+                }
+                break;
+            }
+            // A cached result counts as a run for the schedule and -t
+            bool reused = caching && reuse_result(&pool[i], &now, &exit_val);
+            if (!reused && !start_run(i, launch_at, nwords)) {
+                fprintf(stderr, "Couldn't run command: %s\n", strerror(errno));
+                return 1;
+            }
+            int64_t late_ns;
+            pool[i].tick = next_exec;
+            pool[i].ticked = precise && advance_schedule(&next_exec, &now, &late_ns);
+            if (pool[i].ticked) {
+                pool[i].late_ns = late_ns;
+                if (reused) {
+                    stats_record_lateness(late_ns);
+                    pool[i].ticked = false;
+                }
+            }
+            triggered = false;
+            if (times > 0) {
+                times--;
+                if (times == 0) {
+                    stopping = true;
+                }
+            }
+            // No child is left to wake us for a reused result
+            struct timespec *next = (precise) ? &next_exec : &pool[i].ready_at;
+            if (reused && (!have_wake || timespec_cmp(next, &wake) < 0)) {
+                wake = *next;
+                have_wake = true;
+            }
+        }
+        // Running out of --args-from or a cached result can leave
+        // nothing to wait for
+        if (stopping && running == 0) {
+            continue;
+        }
+        if (use_timeout) {
+            check_timeouts(&now, &wake, &have_wake);
+        }
+        if (worker) {
+            send_records(&now, &wake, &have_wake);
+        }
+        if (state_path != NULL && state_dirty) {
+            if (timespec_cmp(&now, &state_due) >= 0) {
+                // The runs the state counts as done have to be on
+                // record first, or a crash would lose them for good
+                if (!record_flush()) {
+                    fprintf(stderr, "Fatal error writing records: %s\n", strerror(errno));
+                    return 1;
+                }
+                fill_state(&loop);
+                state_save(&loop);
+                state_dirty = false;
+                state_due = timespec_add(&now, &state_interval_ts);
+            } else if (!have_wake || timespec_cmp(&state_due, &wake) < 0) {
+                wake = state_due;
+                have_wake = true;
+            }
+        }
+        if (!ev_set_timer((have_wake) ? &wake : NULL)) {
+            fprintf(stderr, "Fatal error setting timer: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        uint64_t tags[64];
+        struct timespec waited;
+        if (tracing) {
+            get_time(&now);
+        }
+        int ready = ev_wait(tags, 64);
+        if (tracing) {
+            get_time(&waited);
+            trace_event(TRACE_WAIT, -1, &now, &waited, (ready > 0) ? ready : 0);
+        }
+        if (ready < 0) {
+            fprintf(stderr, "Fatal error waiting: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < ready; i++) {
+            handle_event(tags[i], &exit_val);
         }
+        state_dirty = state_dirty || ready > 0;
     }
 }
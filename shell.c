@@ -0,0 +1,329 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "launch.h"
+#include "shell.h"
+
+// Characters which make the shell do something other than split the
+// command into words.
+static const char *SHELL_METACHARS = "|&;<>()$`\\\"'*?[]#~{}!\n";
+
+// Words which only mean something to the shell when they start the
+// command, because they are keywords or builtins without an external
+// equivalent.
+static const char *SHELL_WORDS[] = {
+    "!", "{", "}", ".", ":", "[[",
+    "alias", "bg", "break", "case", "cd", "command", "continue", "do",
+    "done", "elif", "else", "esac", "eval", "exec", "exit", "export",
+    "fc", "fg", "fi", "for", "function", "getopts", "hash", "if", "in",
+    "jobs", "local", "read", "readonly", "return", "select", "set",
+    "shift", "source", "then", "times", "trap", "type", "ulimit", "umask",
+    "unalias", "unset", "until", "wait", "while",
+    NULL
+};
+
+// Reads requests on fd 3 and reports the exit status of each run on
+// fd 4.  A request is a line of quoted words to run the command with
+// as its positional parameters, which is empty without --args-from.
+// A command killed by a signal looks the same as one exiting with 128
+// plus its number, so as with "sh -c" running a compound command, that
+// is reported as an exit status.  The script's own variables are unset
+// in the subshell before the command is expanded, so the command sees
+// the same variables it would under "sh -c".  The trap keeps the shell
+// alive when the terminal interrupts the command, while subshells
+// still get the default behavior.
+static const char *COPROC_SCRIPT =
+    "__repeat_cmd=$REPEAT_COMMAND; unset REPEAT_COMMAND\n"
+    "trap : INT QUIT\n"
+    "while read -r __repeat_req <&3; do\n"
+    "  (exec 3<&- 4>&-; eval \"set -- $__repeat_req\"; unset __repeat_req\n"
+    "   eval \"unset __repeat_cmd; $__repeat_cmd\")\n"
+    "  echo \"$?\" >&4\n"
+    "done\n";
+
+// Returns true if the command needs a shell to be interpreted the way
+// "sh -c" would, or false if splitting it on blanks gives the same
+// argument vector.
+bool
+shell_needed(const char *command) {
+    size_t first_len;
+
+    if (strpbrk(command, SHELL_METACHARS) != NULL) {
+        return true;
+    }
+    command += strspn(command, " \t");
+    first_len = strcspn(command, " \t");
+    if (first_len == 0) {
+        return true;
+    }
+    // A leading NAME=value is a variable assignment
+    if (memchr(command, '=', first_len) != NULL) {
+        return true;
+    }
+    for (int i = 0; SHELL_WORDS[i] != NULL; i++) {
+        if (strlen(SHELL_WORDS[i]) == first_len &&
+            strncmp(command, SHELL_WORDS[i], first_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the length of the line shell_quote() makes from words.
+size_t
+shell_quoted_len(char *const words[], int count) {
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++) {
+        len += (i > 0) ? 3 : 2;
+        for (const char *p = words[i]; *p != '\0'; p++) {
+            len += (*p == '\'') ? 4 : 1;
+        }
+    }
+    return len;
+}
+
+// Writes the line shell_quote() makes from words to line, which has
+// room for shell_quoted_len() and a NUL, and returns where it ends.
+char *
+shell_quote_to(char *line, char *const words[], int count) {
+    char *q = line;
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            *q++ = ' ';
+        }
+        *q++ = '\'';
+        for (const char *p = words[i]; *p != '\0'; p++) {
+            if (*p == '\'') {
+                memcpy(q, "'\\''", 4);
+                q += 4;
+            } else {
+                *q++ = *p;
+            }
+        }
+        *q++ = '\'';
+    }
+    *q = '\0';
+    return q;
+}
+
+// Joins count words into a line for the shell to split back into the
+// same words, quoting every one.  Returns a string for the caller to
+// free, or NULL if out of memory.
+char *
+shell_quote(char *const words[], int count) {
+    char *line = malloc(shell_quoted_len(words, count) + 1);
+
+    if (line != NULL) {
+        shell_quote_to(line, words, count);
+    }
+    return line;
+}
+
+// Splits a command which doesn't need a shell into a NULL-terminated
+// argument vector.  The words are stored in a single copy of the
+// command.
+char **
+shell_split(const char *command) {
+    char *words = strdup(command);
+    size_t count = 0;
+    char **result;
+    char *tok;
+
+    for (const char *p = command; *p != '\0'; ) {
+        p += strspn(p, " \t");
+        if (*p != '\0') {
+            count++;
+            p += strcspn(p, " \t");
+        }
+    }
+    result = calloc(count + 1, sizeof(char *));
+    count = 0;
+    for (tok = strtok(words, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+        result[count++] = tok;
+    }
+    return result;
+}
+
+static void
+move_fd_above(int *fd, int min) {
+    if (*fd <= min) {
+        int moved = fcntl(*fd, F_DUPFD_CLOEXEC, min + 1);
+        if (moved >= 0) {
+            close(*fd);
+            *fd = moved;
+        }
+    }
+}
+
+// Starts a coprocess running file, which is told how to find its end
+// of the protocol by the environment variable name set to value.
+static bool
+coproc_start(struct shell_coproc *sh, const char *file, char **argv,
+             const char *name, const char *value, int output_fd, int noutputs) {
+    int request[2], status[2];
+
+    if (pipe2(request, O_CLOEXEC) < 0) {
+        return false;
+    }
+    if (pipe2(status, O_CLOEXEC) < 0) {
+        close(request[0]);
+        close(request[1]);
+        return false;
+    }
+
+    // The dups are applied in order, so the output descriptor goes
+    // first in case it is 3 or 4, and the pipes are moved clear of
+    // the descriptors they are about to be installed as.
+    move_fd_above(&request[0], 4);
+    move_fd_above(&status[1], 4);
+    struct launch_dup dups[4];
+    int ndups = 0;
+    for (int i = 0; i < noutputs; i++) {
+        dups[ndups++] = (struct launch_dup){ output_fd, 1 + i };
+    }
+    dups[ndups++] = (struct launch_dup){ request[0], 3 };
+    dups[ndups++] = (struct launch_dup){ status[1], 4 };
+    setenv(name, value, true);
+    sh->pid = launch_command(file, argv, dups, ndups);
+    int saved_errno = errno;
+    unsetenv(name);
+    close(request[0]);
+    close(status[1]);
+    if (sh->pid < 0) {
+        sh->pid = 0;
+        close(request[1]);
+        close(status[0]);
+        errno = saved_errno;
+        return false;
+    }
+    sh->request_fd = request[1];
+    sh->status_fd = status[0];
+    sh->hungup = false;
+    sh->buflen = 0;
+    return true;
+}
+
+// Closes our end of a coprocess whose pid has been reaped.
+void
+shell_coproc_reaped(struct shell_coproc *sh) {
+    close(sh->request_fd);
+    close(sh->status_fd);
+    sh->pid = 0;
+}
+
+// Notes that a coprocess has closed its end, leaving it to be reaped.
+static int
+shell_coproc_hangup(struct shell_coproc *sh) {
+    sh->hungup = true;
+    return -1;
+}
+
+// Sends a whole request, which the coprocess is idle to read.
+static bool
+send_request(int fd, const char *request, size_t len) {
+    while (len > 0) {
+        ssize_t done = write(fd, request, len);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done < 0) {
+            return false;
+        }
+        request += done;
+        len -= done;
+    }
+    return true;
+}
+
+// Asks the coprocess to run once with the given request line, starting
+// it first if necessary with the first noutputs of stdout and stderr
+// going to output_fd.  A coprocess which has exited since its last run
+// (the command may have killed it) is replaced.
+static bool
+coproc_run(struct shell_coproc *sh, const char *file, char **argv,
+           const char *name, const char *value, const char *request,
+           int output_fd, int noutputs) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (sh->pid == 0 &&
+            !coproc_start(sh, file, argv, name, value, output_fd, noutputs)) {
+            return false;
+        }
+        if (send_request(sh->request_fd, request, strlen(request))) {
+            return true;
+        }
+        if (errno != EPIPE) {
+            return false;
+        }
+        waitpid(sh->pid, NULL, 0);
+        shell_coproc_reaped(sh);
+    }
+    return false;
+}
+
+// Runs the command once in a subshell of the coprocess shell, with
+// the words of request, a line from shell_quote() ending in a newline,
+// as its positional parameters, or none if it's NULL.
+bool
+shell_coproc_run(struct shell_coproc *sh, const char *command, const char *request,
+                 int output_fd, int noutputs) {
+    char *argv[] = { "sh", "-c", (char *)COPROC_SCRIPT, NULL };
+
+    sh->signals = false;
+    return coproc_run(sh, "/bin/sh", argv, "REPEAT_COMMAND", command,
+                      (request != NULL) ? request : "\n", output_fd, noutputs);
+}
+
+// Runs the command once by asking a --zygote, which is the command
+// itself, to fork a copy of its initialized self.  REPEAT_ZYGOTE tells
+// it which descriptors carry the requests and results, which follow
+// the same protocol as the coprocess shell, except that a status of
+// 128 plus a signal number is documented to mean death by that signal.
+bool
+shell_zygote_run(struct shell_coproc *sh, const char *file, char **argv,
+                 int output_fd, int noutputs) {
+    sh->signals = true;
+    return coproc_run(sh, file, argv, "REPEAT_ZYGOTE", "3,4", "\n",
+                      output_fd, noutputs);
+}
+
+// Reads the result of a run from the coprocess.  Returns 1 and sets
+// *status to a wait()-style status when one is available, 0 if it is
+// still incomplete, and -1 if the coprocess closed its end, after
+// which hungup is set.
+int
+shell_coproc_status(struct shell_coproc *sh, int *status) {
+    ssize_t len = read(sh->status_fd, sh->buf + sh->buflen,
+                       sizeof(sh->buf) - 1 - sh->buflen);
+    if (len < 0) {
+        return (errno == EINTR || errno == EAGAIN) ? 0 : shell_coproc_hangup(sh);
+    }
+    if (len == 0) {
+        return shell_coproc_hangup(sh);
+    }
+    sh->buflen += len;
+    sh->buf[sh->buflen] = '\0';
+    if (strchr(sh->buf, '\n') == NULL) {
+        return (sh->buflen < sizeof(sh->buf) - 1) ? 0 : shell_coproc_hangup(sh);
+    }
+
+    // A zygote reports death by signal as 128 plus the signal number,
+    // so convert that back to what wait() would say.
+    int code = atoi(sh->buf);
+    sh->buflen = 0;
+    if (sh->signals && code > 128 && code < 128 + NSIG) {
+        *status = code - 128;
+    } else {
+        *status = (code & 0xff) << 8;
+    }
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef REPEAT_SHELL_H
+#define REPEAT_SHELL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A long-lived shell which runs the command in a subshell each time
+// it is asked to, so that the cost of starting /bin/sh is paid once
+// rather than on every invocation.
+struct shell_coproc {
+    pid_t pid;              // 0 when not running
+    int request_fd;         // one byte written per invocation
+    int status_fd;          // one line of "$?" read back per invocation
+    bool hungup;            // status_fd has reached EOF
+    bool signals;           // statuses over 128 are 128 plus a signal number
+    char buf[16];
+    size_t buflen;
+};
+
+bool shell_needed(const char *command);
+char **shell_split(const char *command);
+size_t shell_quoted_len(char *const words[], int count);
+char *shell_quote_to(char *line, char *const words[], int count);
+char *shell_quote(char *const words[], int count);
+bool shell_coproc_run(struct shell_coproc *sh, const char *command, const char *request,
+                      int output_fd, int noutputs);
+bool shell_zygote_run(struct shell_coproc *sh, const char *file, char **argv,
+                      int output_fd, int noutputs);
+int shell_coproc_status(struct shell_coproc *sh, int *status);
+void shell_coproc_reaped(struct shell_coproc *sh);
+
+#endif
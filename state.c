@@ -0,0 +1,181 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "duration.h"
+#include "hash.h"
+#include "state.h"
+#include "stats.h"
+
+// The state file is memory-mapped and holds two snapshots of the loop
+// and its statistics.  Each save writes over the older one.  The kernel
+// is asked to write the pages back, but repeat doesn't wait for it to,
+// except on the last save, so after a crash the pages of a snapshot may
+// have reached the disk in any order.  Each snapshot therefore carries
+// a generation and a checksum over it, and the newest one which checks
+// out is resumed from, which a save cut short leaves the other to be.
+//
+// Times are kept as CLOCK_REALTIME, which unlike the monotonic clock
+// means the same after a reboot, and the elapsed time of the run so
+// far as a count.  The file is only meaningful to the same build of
+// repeat on the same kind of machine, which the size of a snapshot
+// mostly checks.
+#define STATE_MAGIC "repeatS"
+#define STATE_VERSION 2
+
+struct snapshot {
+    uint64_t generation;        // 0 until first written
+    uint64_t checksum;          // of the generation and what follows
+    struct state_loop loop;
+    int64_t next_exec_ns;       // CLOCK_REALTIME, replacing loop.next_exec
+    int64_t elapsed_ns;
+    struct stats stats;
+};
+
+struct state_file {
+    char magic[8];
+    uint32_t version;
+    uint32_t snapshot_size;
+    uint64_t command_hash;
+    struct snapshot snap[2];
+};
+
+static int state_fd = -1;
+static struct state_file *file = NULL;
+
+static uint64_t
+snapshot_checksum(const struct snapshot *snap) {
+    struct xxh64 h;
+
+    xxh64_init(&h, 0);
+    xxh64_update(&h, &snap->generation, sizeof(snap->generation));
+    xxh64_update(&h, &snap->loop, sizeof(*snap) - offsetof(struct snapshot, loop));
+    return xxh64_digest(&h);
+}
+
+// Returns the newest snapshot which was written in full, or NULL if
+// there is none.
+static const struct snapshot *
+newest_snapshot(void) {
+    const struct snapshot *newest = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        const struct snapshot *snap = &file->snap[i];
+        if (snap->generation == 0 || snap->checksum != snapshot_checksum(snap)) {
+            continue;
+        }
+        if (newest == NULL || snap->generation > newest->generation) {
+            newest = snap;
+        }
+    }
+    return newest;
+}
+
+// Opens the state in path, creating it if need be, and locks it
+// against other copies of repeat.  If it holds a snapshot for the same
+// command, restores the statistics from it and fills in *loop.
+enum state_result
+state_open(const char *path, uint64_t command_hash, struct state_loop *loop) {
+    struct stat st;
+
+    state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (state_fd < 0) {
+        return STATE_ERROR;
+    }
+    if (flock(state_fd, LOCK_EX | LOCK_NB) < 0 || fstat(state_fd, &st) < 0) {
+        return STATE_ERROR;
+    }
+    bool fresh = (st.st_size == 0);
+    if (fresh && ftruncate(state_fd, sizeof(*file)) < 0) {
+        return STATE_ERROR;
+    }
+    if (!fresh && st.st_size != sizeof(*file)) {
+        return STATE_OTHER;
+    }
+    file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (file == MAP_FAILED) {
+        file = NULL;
+        return STATE_ERROR;
+    }
+    if (fresh) {
+        memcpy(file->magic, STATE_MAGIC, sizeof(file->magic));
+        file->version = STATE_VERSION;
+        file->snapshot_size = sizeof(struct snapshot);
+        file->command_hash = command_hash;
+        return STATE_NEW;
+    }
+    if (memcmp(file->magic, STATE_MAGIC, sizeof(file->magic)) != 0 ||
+        file->version != STATE_VERSION || file->snapshot_size != sizeof(struct snapshot) ||
+        file->command_hash != command_hash) {
+        return STATE_OTHER;
+    }
+    if (file->snap[0].generation == 0 && file->snap[1].generation == 0) {
+        return STATE_NEW;
+    }
+
+    const struct snapshot *snap = newest_snapshot();
+    if (snap == NULL) {
+        return STATE_DAMAGED;
+    }
+    struct timespec now, real_now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &real_now);
+    *loop = snap->loop;
+    if (loop->have_schedule) {
+        struct timespec offset = timespec_from_ns(snap->next_exec_ns - timespec_to_ns(&real_now));
+        loop->next_exec = timespec_add(&now, &offset);
+    }
+    stats = snap->stats;
+    struct timespec elapsed = timespec_from_ns(snap->elapsed_ns);
+    stats.started = timespec_sub(&now, &elapsed);
+    return STATE_RESUMED;
+}
+
+// Writes a snapshot of loop and the statistics over the older one.
+void
+state_save(const struct state_loop *loop) {
+    struct timespec now, real_now;
+
+    if (file == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &real_now);
+    // Write over the older snapshot, or one which didn't check out
+    const struct snapshot *newest = newest_snapshot();
+    uint64_t generation = (newest != NULL) ? newest->generation + 1 : 1;
+    struct snapshot *snap = &file->snap[newest == &file->snap[0]];
+    snap->generation = generation;
+    snap->loop = *loop;
+    if (loop->have_schedule) {
+        struct timespec offset = timespec_sub(&loop->next_exec, &now);
+        snap->next_exec_ns = timespec_to_ns(&real_now) + timespec_to_ns(&offset);
+    }
+    struct timespec elapsed = timespec_sub(&now, &stats.started);
+    snap->elapsed_ns = timespec_to_ns(&elapsed);
+    snap->stats = stats;
+    snap->checksum = snapshot_checksum(snap);
+    msync(file, sizeof(*file), MS_ASYNC);
+}
+
+// Saves a last snapshot and waits for it to reach the disk.
+bool
+state_close(const struct state_loop *loop) {
+    if (file == NULL) {
+        return true;
+    }
+    state_save(loop);
+    bool ok = msync(file, sizeof(*file), MS_SYNC) == 0;
+    munmap(file, sizeof(*file));
+    file = NULL;
+    close(state_fd);
+    state_fd = -1;
+    return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef REPEAT_STATE_H
+#define REPEAT_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// What the main loop needs to carry on where it left off, besides the
+// statistics.
+struct state_loop {
+    bool limited;               // --times was given
+    bool finished;              // it ran to the end, rather than being stopped
+    bool have_schedule;         // the next tick of a --precise schedule is known
+    int32_t exit_val;           // to exit with, when finished
+    int64_t times;              // left to run, when limited
+    uint64_t launched;
+    struct timespec next_exec;  // CLOCK_MONOTONIC, for this boot
+};
+
+enum state_result {
+    STATE_ERROR = -1,           // see errno
+    STATE_NEW,                  // nothing to resume from
+    STATE_RESUMED,
+    STATE_OTHER,                // written for some other command
+    STATE_DAMAGED,              // no snapshot in it was written in full
+};
+
+enum state_result state_open(const char *path, uint64_t command_hash, struct state_loop *loop);
+void state_save(const struct state_loop *loop);
+bool state_close(const struct state_loop *loop);
+
+#endif
@@ -0,0 +1,407 @@
+#include "config.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "duration.h"
+#include "stats.h"
+
+struct stats stats;
+
+void
+stats_init(void) {
+    stats.runs = 0;
+    stats.failures = 0;
+    stats.timeouts = 0;
+    stats.cached = 0;
+    stats.missed_ticks = 0;
+    hist_init(&stats.latency);
+    hist_init(&stats.lateness);
+    hist_init(&stats.memory_peak);
+    hist_init(&stats.cgroup_cpu);
+    clock_gettime(CLOCK_MONOTONIC, &stats.started);
+    stats.warmed_up = 0;
+    stats.outliers = 0;
+    memset(&stats.estimate, 0, sizeof(stats.estimate));
+    for (int i = 0; i < 2; i++) {
+        stats.variant[i].runs = 0;
+        stats.variant[i].failures = 0;
+        hist_init(&stats.variant[i].latency);
+    }
+}
+
+// Runs far outside the rest, such as one that had to wait for a disk
+// or was descheduled, are left out of the estimate: anything more than
+// three interquartile ranges beyond the middle half of the run times
+// so far, which are Tukey's fences for far outliers.  The spread is at
+// least a histogram bucket, so that runs all taking much the same time
+// don't make every slightly different one an outlier.
+#define OUTLIER_MIN_RUNS 20
+#define OUTLIER_FENCE 3.0
+
+static bool
+is_outlier(int64_t ns) {
+    const struct histogram *h = &stats.latency;
+
+    if (h->count < OUTLIER_MIN_RUNS) {
+        return false;
+    }
+    double q1 = hist_quantile(h, 0.25), q3 = hist_quantile(h, 0.75);
+    double spread = fmax(q3 - q1, q3 / HIST_SUB_COUNT);
+    return ns < q1 - OUTLIER_FENCE * spread || ns > q3 + OUTLIER_FENCE * spread;
+}
+
+static void
+estimate_add(struct welford *w, double value) {
+    double delta = value - w->mean;
+
+    w->n++;
+    w->mean += delta / w->n;
+    w->m2 += delta * (value - w->mean);
+}
+
+// Records a finished run.  Returns false if it was left out, as one
+// of the --warmup runs.
+bool
+stats_record(const struct timespec *start, const struct timespec *end,
+             int status, bool timed_out) {
+    struct timespec elapsed = timespec_sub(end, start);
+    int64_t ns = timespec_to_ns(&elapsed);
+
+    if (stats.warmup > 0) {
+        stats.warmup--;
+        stats.warmed_up++;
+        return false;
+    }
+    stats.runs++;
+    if (timed_out) {
+        stats.timeouts++;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        stats.failures++;
+    }
+    if (stats.estimating) {
+        if (is_outlier(ns)) {
+            stats.outliers++;
+        } else {
+            estimate_add(&stats.estimate, ns);
+        }
+    }
+    hist_record(&stats.latency, (ns > 0) ? (uint64_t)ns : 0);
+    return true;
+}
+
+// Records a run recorded by stats_record() against the command it
+// ran, 0 for the main one or 1 for --compare's.
+void
+stats_record_variant(int variant, const struct timespec *start,
+                     const struct timespec *end, int status, bool timed_out) {
+    struct variant_stats *v = &stats.variant[variant];
+    struct timespec elapsed = timespec_sub(end, start);
+    int64_t ns = timespec_to_ns(&elapsed);
+
+    v->runs++;
+    if (timed_out || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        v->failures++;
+    }
+    hist_record(&v->latency, (ns > 0) ? (uint64_t)ns : 0);
+}
+
+// How much larger b is than a, in percent
+static double
+percent_change(double a, double b) {
+    return (a > 0) ? 100 * (b - a) / a : 0.0;
+}
+
+// Student's t for a two-sided 95% interval, by degrees of freedom
+static const double t_95[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+#define T_95_ROWS (sizeof(t_95) / sizeof(t_95[0]))
+
+// Gives the mean run time in ns and the half width of a 95% confidence
+// interval for it.  Returns false until there are enough runs to say.
+bool
+stats_interval(double *mean, double *half_width) {
+    const struct welford *w = &stats.estimate;
+
+    if (w->n < 2) {
+        return false;
+    }
+    uint64_t df = w->n - 1;
+    double t = (df < T_95_ROWS) ? t_95[df] : 1.96;
+    *mean = w->mean;
+    *half_width = t * sqrt(w->m2 / df / w->n);
+    return true;
+}
+
+// Records what a run's cgroup said it used.  Either may be -1 if the
+// cgroup couldn't say.
+void
+stats_record_cgroup(int64_t memory_peak, int64_t cpu_us) {
+    if (memory_peak >= 0) {
+        hist_record(&stats.memory_peak, memory_peak);
+    }
+    if (cpu_us >= 0) {
+        hist_record(&stats.cgroup_cpu, cpu_us);
+    }
+}
+
+// Records an invocation which --cache answered without running it.
+void
+stats_record_cached(void) {
+    stats.cached++;
+}
+
+// Records how far behind the precise schedule a launch started.
+void
+stats_record_lateness(int64_t lateness) {
+    hist_record(&stats.lateness, (lateness > 0) ? (uint64_t)lateness : 0);
+}
+
+// Records ticks of the precise schedule dropped without being run.
+void
+stats_record_missed(uint64_t missed) {
+    stats.missed_ticks += missed;
+}
+
+// Writes a duration in nanoseconds with a unit suited to its size.
+static void
+print_duration(FILE *out, const char *label, double ns) {
+    if (ns < 1e3) {
+        fprintf(out, " %s %.0fns", label, ns);
+    } else if (ns < 1e6) {
+        fprintf(out, " %s %.2fus", label, ns / 1e3);
+    } else if (ns < 1e9) {
+        fprintf(out, " %s %.2fms", label, ns / 1e6);
+    } else {
+        fprintf(out, " %s %.3fs", label, ns / 1e9);
+    }
+}
+
+// Writes a size in bytes with a binary unit suited to it.
+static void
+print_size(FILE *out, const char *label, double bytes) {
+    if (bytes < 1024) {
+        fprintf(out, " %s %.0fB", label, bytes);
+    } else if (bytes < 1024 * 1024) {
+        fprintf(out, " %s %.1fK", label, bytes / 1024);
+    } else if (bytes < 1024 * 1024 * 1024) {
+        fprintf(out, " %s %.1fM", label, bytes / (1024 * 1024));
+    } else {
+        fprintf(out, " %s %.2fG", label, bytes / (1024 * 1024 * 1024));
+    }
+}
+
+static double
+timeval_secs(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void
+stats_print(FILE *out, enum stats_format format) {
+    const struct histogram *h = &stats.latency;
+    const struct histogram *late = &stats.lateness;
+    const struct histogram *mem = &stats.memory_peak;
+    const struct histogram *cpu = &stats.cgroup_cpu;
+    struct rusage usage, self;
+    struct timespec now, elapsed;
+    uint64_t min = (h->count) ? h->min : 0;
+
+    getrusage(RUSAGE_CHILDREN, &usage);
+    getrusage(RUSAGE_SELF, &self);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = timespec_sub(&now, &stats.started);
+    double secs = timespec_to_ns(&elapsed) / 1e9;
+    double rate = (secs > 0) ? stats.runs / secs : 0.0;
+    double mean, half_width;
+    bool have_interval = stats.estimating && stats_interval(&mean, &half_width);
+    if (format == STATS_JSON) {
+        fprintf(out, "{\"runs\":%" PRIu64 ",\"failures\":%" PRIu64 ",\"timeouts\":%" PRIu64
+                ",\"cached\":%" PRIu64 ",\"elapsed_s\":%.6f,\"runs_per_s\":%.1f"
+                ",\"min_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"mean_ns\":%.0f"
+                ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64
+                ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64
+                ",\"ticks\":%" PRIu64 ",\"missed_ticks\":%" PRIu64
+                ",\"lateness_p50_ns\":%" PRIu64 ",\"lateness_p99_ns\":%" PRIu64
+                ",\"max_lateness_ns\":%" PRIu64
+                ",\"user_cpu_s\":%.6f,\"system_cpu_s\":%.6f"
+                ",\"self_user_cpu_s\":%.6f,\"self_system_cpu_s\":%.6f",
+                stats.runs, stats.failures, stats.timeouts, stats.cached, secs, rate,
+                min, h->max, hist_mean(h),
+                hist_quantile(h, 0.50), hist_quantile(h, 0.90),
+                hist_quantile(h, 0.99), hist_quantile(h, 0.999),
+                late->count, stats.missed_ticks,
+                hist_quantile(late, 0.50), hist_quantile(late, 0.99), late->max,
+                timeval_secs(&usage.ru_utime), timeval_secs(&usage.ru_stime),
+                timeval_secs(&self.ru_utime), timeval_secs(&self.ru_stime));
+        if (mem->count > 0) {
+            fprintf(out, ",\"memory_peak_p50_bytes\":%" PRIu64
+                    ",\"memory_peak_p99_bytes\":%" PRIu64
+                    ",\"memory_peak_max_bytes\":%" PRIu64,
+                    hist_quantile(mem, 0.50), hist_quantile(mem, 0.99), mem->max);
+        }
+        if (cpu->count > 0) {
+            fprintf(out, ",\"cgroup_cpu_p50_us\":%" PRIu64 ",\"cgroup_cpu_p99_us\":%" PRIu64
+                    ",\"cgroup_cpu_max_us\":%" PRIu64,
+                    hist_quantile(cpu, 0.50), hist_quantile(cpu, 0.99), cpu->max);
+        }
+        if (stats.warmed_up > 0) {
+            fprintf(out, ",\"warmup\":%" PRIu64, stats.warmed_up);
+        }
+        if (stats.comparing) {
+            double superiority;
+            double p = hist_mann_whitney(&stats.variant[0].latency, &stats.variant[1].latency,
+                                         &superiority);
+            for (int i = 0; i < 2; i++) {
+                const struct variant_stats *v = &stats.variant[i];
+                fprintf(out, ",\"%s\":{\"runs\":%" PRIu64 ",\"failures\":%" PRIu64
+                        ",\"mean_ns\":%.0f,\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64
+                        ",\"p99_ns\":%" PRIu64 "}",
+                        (i == 0) ? "a" : "b", v->runs, v->failures, hist_mean(&v->latency),
+                        hist_quantile(&v->latency, 0.50), hist_quantile(&v->latency, 0.90),
+                        hist_quantile(&v->latency, 0.99));
+            }
+            fprintf(out, ",\"b_vs_a_p50_pct\":%.3f,\"b_vs_a_mean_pct\":%.3f"
+                    ",\"b_slower_prob\":%.4f,\"mann_whitney_p\":%.3g",
+                    percent_change(hist_quantile(&stats.variant[0].latency, 0.50),
+                                   hist_quantile(&stats.variant[1].latency, 0.50)),
+                    percent_change(hist_mean(&stats.variant[0].latency),
+                                   hist_mean(&stats.variant[1].latency)),
+                    superiority, p);
+        }
+        if (have_interval) {
+            fprintf(out, ",\"outliers\":%" PRIu64 ",\"ci95_mean_ns\":%.0f"
+                    ",\"ci95_half_width_ns\":%.0f",
+                    stats.outliers, mean, half_width);
+        }
+        fprintf(out, "}\n");
+    } else {
+        fprintf(out, "runs %" PRIu64 " failures %" PRIu64 " timeouts %" PRIu64,
+                stats.runs, stats.failures, stats.timeouts);
+        if (stats.cached > 0) {
+            fprintf(out, " cached %" PRIu64, stats.cached);
+        }
+        if (stats.warmed_up > 0) {
+            fprintf(out, " warmup %" PRIu64, stats.warmed_up);
+        }
+        fprintf(out, " in %.3fs (%.1f/s)\n", secs, rate);
+        fprintf(out, "latency");
+        print_duration(out, "min", min);
+        print_duration(out, "max", h->max);
+        print_duration(out, "mean", hist_mean(h));
+        fprintf(out, "\n");
+        fprintf(out, "latency");
+        print_duration(out, "p50", hist_quantile(h, 0.50));
+        print_duration(out, "p90", hist_quantile(h, 0.90));
+        print_duration(out, "p99", hist_quantile(h, 0.99));
+        print_duration(out, "p99.9", hist_quantile(h, 0.999));
+        fprintf(out, "\n");
+        if (stats.comparing) {
+            double superiority;
+            double p = hist_mann_whitney(&stats.variant[0].latency, &stats.variant[1].latency,
+                                         &superiority);
+            for (int i = 0; i < 2; i++) {
+                const struct variant_stats *v = &stats.variant[i];
+                fprintf(out, "%s runs %" PRIu64 " failures %" PRIu64, (i == 0) ? "a" : "b",
+                        v->runs, v->failures);
+                print_duration(out, "mean", hist_mean(&v->latency));
+                print_duration(out, "p50", hist_quantile(&v->latency, 0.50));
+                print_duration(out, "p90", hist_quantile(&v->latency, 0.90));
+                print_duration(out, "p99", hist_quantile(&v->latency, 0.99));
+                fprintf(out, "\n");
+            }
+            fprintf(out, "b vs a p50 %+.2f%% mean %+.2f%%, b slower %.1f%% of the time,"
+                    " Mann-Whitney p %.3g%s\n",
+                    percent_change(hist_quantile(&stats.variant[0].latency, 0.50),
+                                   hist_quantile(&stats.variant[1].latency, 0.50)),
+                    percent_change(hist_mean(&stats.variant[0].latency),
+                                   hist_mean(&stats.variant[1].latency)),
+                    100 * superiority, p, (p < 0.05) ? "" : " (not significant)");
+        }
+        if (have_interval) {
+            fprintf(out, "estimate");
+            print_duration(out, "mean", mean);
+            fprintf(out, " +/- %.2f%% (95%% confidence) over %" PRIu64 " runs, %" PRIu64
+                    " outliers left out\n",
+                    (mean > 0) ? 100 * half_width / mean : 0.0, stats.estimate.n,
+                    stats.outliers);
+        }
+        if (late->count > 0) {
+            fprintf(out, "schedule ticks %" PRIu64 " missed %" PRIu64 " lateness",
+                    late->count, stats.missed_ticks);
+            print_duration(out, "p50", hist_quantile(late, 0.50));
+            print_duration(out, "p99", hist_quantile(late, 0.99));
+            print_duration(out, "max", late->max);
+            fprintf(out, "\n");
+        }
+        if (mem->count > 0) {
+            fprintf(out, "cgroup memory peak");
+            print_size(out, "p50", hist_quantile(mem, 0.50));
+            print_size(out, "p99", hist_quantile(mem, 0.99));
+            print_size(out, "max", mem->max);
+            fprintf(out, "\n");
+        }
+        if (cpu->count > 0) {
+            fprintf(out, "cgroup cpu per run");
+            print_duration(out, "p50", hist_quantile(cpu, 0.50) * 1e3);
+            print_duration(out, "p99", hist_quantile(cpu, 0.99) * 1e3);
+            print_duration(out, "max", cpu->max * 1e3);
+            fprintf(out, "\n");
+        }
+        fprintf(out, "cpu user %.3fs system %.3fs, repeat itself user %.3fs system %.3fs\n",
+                timeval_secs(&usage.ru_utime), timeval_secs(&usage.ru_stime),
+                timeval_secs(&self.ru_utime), timeval_secs(&self.ru_stime));
+    }
+    fflush(out);
+}
+
+// Writes a histogram of nanoseconds as a Prometheus histogram in
+// seconds.
+static void
+print_prometheus_histogram(FILE *out, const char *name, const char *help,
+                           const struct histogram *h) {
+    static const double bounds[] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+        0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60,
+    };
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+        fprintf(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name, bounds[i],
+                hist_count_upto(h, bounds[i] * 1e9));
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h->count);
+    fprintf(out, "%s_sum %.9f\n%s_count %" PRIu64 "\n", name, h->sum / 1e9, name, h->count);
+}
+
+static void
+print_prometheus_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+            name, help, name, name, value);
+}
+
+// Writes the totals in the Prometheus text exposition format.
+void
+stats_print_prometheus(FILE *out) {
+    print_prometheus_counter(out, "repeat_runs_total", "Invocations finished.", stats.runs);
+    print_prometheus_counter(out, "repeat_failures_total",
+                             "Invocations which exited unsuccessfully.", stats.failures);
+    print_prometheus_counter(out, "repeat_timeouts_total",
+                             "Invocations killed by --timeout.", stats.timeouts);
+    print_prometheus_counter(out, "repeat_cached_total",
+                             "Invocations answered by --cache without running.", stats.cached);
+    print_prometheus_counter(out, "repeat_schedule_ticks_total",
+                             "Ticks of the --precise schedule launched.", stats.lateness.count);
+    print_prometheus_counter(out, "repeat_missed_ticks_total",
+                             "Ticks of the --precise schedule missed.", stats.missed_ticks);
+    print_prometheus_histogram(out, "repeat_run_duration_seconds",
+                               "Wall time of each invocation.", &stats.latency);
+    print_prometheus_histogram(out, "repeat_schedule_lateness_seconds",
+                               "How late each --precise launch was.", &stats.lateness);
+}
@@ -0,0 +1,64 @@
+#ifndef REPEAT_STATS_H
+#define REPEAT_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "histogram.h"
+
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+// A running mean and variance, by Welford's method.
+struct welford {
+    uint64_t n;
+    double mean;
+    double m2;              // sum of squared differences from the mean
+};
+
+// Totals over every invocation which has finished.
+struct stats {
+    uint64_t runs;
+    uint64_t failures;
+    uint64_t timeouts;          // runs killed by --timeout
+    uint64_t cached;            // invocations answered by --cache instead
+    struct histogram latency;   // wall time of each run in ns
+    struct histogram lateness;  // start delay behind the precise schedule
+    uint64_t missed_ticks;
+    struct histogram memory_peak;   // bytes, from each run's cgroup
+    struct histogram cgroup_cpu;    // microseconds, from each run's cgroup
+    struct timespec started;
+    uint64_t warmup;            // runs still to leave out, from --warmup
+    uint64_t warmed_up;         // runs left out by --warmup
+    bool estimating;            // keep the estimate for --until-stable
+    uint64_t outliers;          // runs left out of the estimate
+    struct welford estimate;    // of the run time in ns
+    bool comparing;             // runs alternate between two commands
+    struct variant_stats {      // of each command, with --compare
+        uint64_t runs;
+        uint64_t failures;
+        struct histogram latency;
+    } variant[2];
+};
+
+extern struct stats stats;
+
+void stats_init(void);
+bool stats_record(const struct timespec *start, const struct timespec *end,
+                  int status, bool timed_out);
+void stats_record_variant(int variant, const struct timespec *start,
+                          const struct timespec *end, int status, bool timed_out);
+void stats_record_cgroup(int64_t memory_peak, int64_t cpu_us);
+void stats_record_cached(void);
+void stats_record_lateness(int64_t lateness);
+void stats_record_missed(uint64_t missed);
+bool stats_interval(double *mean, double *half_width);
+void stats_print(FILE *out, enum stats_format format);
+void stats_print_prometheus(FILE *out);
+
+#endif
@@ -0,0 +1,108 @@
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "duration.h"
+#include "trace.h"
+
+// Events are stored in binary in a fixed ring, and only turned into
+// Chrome trace-event JSON when the ring fills or tracing stops, so
+// recording one costs a few stores.
+#define TRACE_RING 4096
+
+struct trace_record {
+    int64_t start_ns;
+    int64_t dur_ns;
+    uint64_t arg;
+    int32_t slot;           // -1 for the main loop itself
+    uint32_t kind;
+};
+
+static const char *kind_names[] = {
+    [TRACE_WAIT] = "wait",
+    [TRACE_LAUNCH] = "launch",
+    [TRACE_RUN] = "run",
+    [TRACE_REAP] = "reap",
+};
+
+bool tracing = false;
+static FILE *trace_file = NULL;
+static struct trace_record ring[TRACE_RING];
+static int ring_len = 0;
+static int64_t origin_ns;
+
+// Starts a trace in path, with times counted from now.  The file is a
+// JSON array of events, which chrome://tracing and Perfetto load even
+// if repeat dies before closing it.
+bool
+trace_open(const char *path) {
+    struct timespec now;
+
+    trace_file = fopen(path, "we");
+    if (trace_file == NULL) {
+        return false;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    origin_ns = timespec_to_ns(&now);
+    fprintf(trace_file, "[{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+            "\"args\":{\"name\":\"repeat\"}}", (int)getpid());
+    tracing = true;
+    return true;
+}
+
+static bool
+trace_flush(void) {
+    int pid = getpid();
+
+    for (int i = 0; i < ring_len; i++) {
+        const struct trace_record *t = &ring[i];
+        // Runs go on a track per slot, so that jobs show side by side
+        fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d",
+                kind_names[t->kind], t->start_ns / 1e3, t->dur_ns / 1e3, pid,
+                (t->kind == TRACE_RUN) ? t->slot + 1 : 0);
+        if (t->slot >= 0) {
+            fprintf(trace_file, ",\"args\":{\"slot\":%d,\"%s\":%" PRIu64 "}}",
+                    t->slot, (t->kind == TRACE_REAP) ? "status" : "iteration", t->arg);
+        } else {
+            fprintf(trace_file, ",\"args\":{\"events\":%" PRIu64 "}}", t->arg);
+        }
+    }
+    ring_len = 0;
+    return !ferror(trace_file);
+}
+
+// Records that something of the given kind took from start to end.
+// For slot -1, arg is the number of events a wait returned; otherwise
+// it is the iteration, or for TRACE_REAP the wait() status.
+void
+trace_event(enum trace_kind kind, int slot, const struct timespec *start,
+            const struct timespec *end, uint64_t arg) {
+    struct trace_record *t = &ring[ring_len++];
+    struct timespec dur = timespec_sub(end, start);
+
+    t->start_ns = timespec_to_ns(start) - origin_ns;
+    t->dur_ns = timespec_to_ns(&dur);
+    t->arg = arg;
+    t->slot = slot;
+    t->kind = kind;
+    if (ring_len == TRACE_RING) {
+        trace_flush();
+    }
+}
+
+bool
+trace_close(void) {
+    if (trace_file == NULL) {
+        return true;
+    }
+    bool ok = trace_flush();
+    fprintf(trace_file, "\n]\n");
+    ok = (fclose(trace_file) == 0) && ok;
+    trace_file = NULL;
+    tracing = false;
+    return ok;
+}
@@ -0,0 +1,22 @@
+#ifndef REPEAT_TRACE_H
+#define REPEAT_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum trace_kind {
+    TRACE_WAIT,         // the main loop waiting for something to happen
+    TRACE_LAUNCH,       // starting a child or asking a coprocess to run
+    TRACE_RUN,          // an invocation, from start to being noticed done
+    TRACE_REAP,         // collecting the results of a finished invocation
+};
+
+extern bool tracing;
+
+bool trace_open(const char *path);
+void trace_event(enum trace_kind kind, int slot, const struct timespec *start,
+                 const struct timespec *end, uint64_t arg);
+bool trace_close(void);
+
+#endif
@@ -0,0 +1,136 @@
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// The event loop needs few enough operations that the rings are set up
+// and driven with the system calls directly, rather than through
+// liburing.  There is one ring, only ever used from the main loop.
+static int ring_fd = -1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static unsigned sq_entries;
+static unsigned queued_tail;    // of the entries filled in, not yet given to the kernel
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static uint64_t enters;         // system calls made on the ring
+
+// Creates the ring.  Fails on kernels without io_uring, or where it
+// has been turned off, as it often is in containers.
+bool
+uring_init(unsigned nsq, unsigned ncq) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = ncq;
+    int fd = syscall(__NR_io_uring_setup, nsq, &p);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    char *cq = (single) ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+        munmap(sq, sq_size);
+        close(fd);
+        return false;
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(cq, cq_size);
+        }
+        munmap(sq, sq_size);
+        close(fd);
+        return false;
+    }
+
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    queued_tail = *sq_tail;
+    ring_fd = fd;
+    return true;
+}
+
+// Returns a cleared submission entry, to be submitted by the next
+// uring_enter().  When the ring is full what's queued is submitted
+// first; returns NULL if that fails.
+struct io_uring_sqe *
+uring_sqe(void) {
+    if (queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        if (uring_enter(0) < 0 ||
+            queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned idx = queued_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[idx] = idx;
+    queued_tail++;
+    return sqe;
+}
+
+// Submits everything queued and, in the same system call, waits for
+// at least wait completions to be ready.  Returns 0, or -1 with errno
+// set.
+int
+uring_enter(unsigned wait) {
+    __atomic_store_n(sq_tail, queued_tail, __ATOMIC_RELEASE);
+    unsigned pending = queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    enters++;
+    if (syscall(__NR_io_uring_enter, ring_fd, pending, wait,
+                (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Returns how many times the ring has been entered.
+uint64_t
+uring_enter_count(void) {
+    return enters;
+}
+
+// Takes the next completion, if there is one.
+bool
+uring_next(struct io_uring_cqe *cqe) {
+    unsigned head = *cq_head;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef REPEAT_URING_H
+#define REPEAT_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+bool uring_init(unsigned sq_entries, unsigned cq_entries);
+struct io_uring_sqe *uring_sqe(void);
+int uring_enter(unsigned wait);
+uint64_t uring_enter_count(void);
+bool uring_next(struct io_uring_cqe *cqe);
+
+#endif
@@ -0,0 +1,164 @@
+#include "config.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+// Anything which changes what's at a path, including editors which
+// save by writing a new file and renaming it over the old one.
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+                      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+// What brings a missing path back, watched for on its directory.
+#define RETURN_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+struct watch {
+    const char *path;
+    char *parent;           // the directory holding path
+    char *name;             // path within parent
+    int wd;                 // -1 while the path doesn't exist
+    int parent_wd;          // watching parent for it to come back, or -1
+};
+
+static struct watch *watches = NULL;
+static int nwatches = 0;
+static int notify_fd = -1;
+
+// Remembers a path to watch once watch_init() is called.
+bool
+watch_add(const char *path) {
+    struct watch *w = realloc(watches, (nwatches + 1) * sizeof(*w));
+
+    if (w == NULL) {
+        return false;
+    }
+    watches = w;
+    w = &watches[nwatches];
+    char *dir = strdup(path), *base = strdup(path);
+    if (dir == NULL || base == NULL) {
+        free(dir);
+        free(base);
+        return false;
+    }
+    w->path = path;
+    w->parent = dirname(dir);
+    w->name = basename(base);
+    w->wd = -1;
+    w->parent_wd = -1;
+    nwatches++;
+    return true;
+}
+
+// Whether any watch uses wd, other than as the parent of skip.
+static bool
+wd_in_use(int wd, const struct watch *skip) {
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].wd == wd || (&watches[i] != skip && watches[i].parent_wd == wd)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Watches a missing path again if it has come back, and otherwise its
+// directory for it to.  Returns true if it has come back.
+static bool
+rewatch(struct watch *w) {
+    w->wd = inotify_add_watch(notify_fd, w->path, WATCH_EVENTS);
+    if (w->wd < 0 && w->parent_wd < 0) {
+        // The directory may also be watched, hence adding to its mask
+        w->parent_wd = inotify_add_watch(notify_fd, w->parent, RETURN_EVENTS | IN_MASK_ADD);
+        // In case it came back before the directory was watched
+        w->wd = inotify_add_watch(notify_fd, w->path, WATCH_EVENTS);
+    }
+    if (w->wd < 0) {
+        return false;
+    }
+    if (w->parent_wd >= 0 && !wd_in_use(w->parent_wd, w)) {
+        inotify_rm_watch(notify_fd, w->parent_wd);
+    }
+    w->parent_wd = -1;
+    return true;
+}
+
+// Whether an event is about one of the paths rather than something
+// else in a directory watched for a missing one.
+static bool
+watched_event(const struct inotify_event *ev) {
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].wd == ev->wd) {
+            return true;
+        }
+        if (watches[i].parent_wd == ev->wd && watches[i].wd < 0 &&
+            (ev->mask & RETURN_EVENTS) && ev->len > 0 && strcmp(ev->name, watches[i].name) == 0) {
+            return true;
+        }
+    }
+    return ev->wd < 0;
+}
+
+// Starts watching every path given to watch_add().  Returns an
+// inotify descriptor which becomes readable on changes, or -1 if
+// any of the paths couldn't be watched.
+int
+watch_init(void) {
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < nwatches; i++) {
+        watches[i].wd = inotify_add_watch(notify_fd, watches[i].path, WATCH_EVENTS);
+        if (watches[i].wd < 0) {
+            int saved = errno;
+            close(notify_fd);
+            notify_fd = -1;
+            errno = saved;
+            return -1;
+        }
+    }
+    return notify_fd;
+}
+
+// Reads the pending events.  Returns true if any of them was a
+// change.  A path which was deleted or renamed over is watched again
+// if something has taken its place, or else its directory is watched
+// until something does.  If the directory is gone as well, the path
+// is only looked for again on a later event.
+bool
+watch_read(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+
+    while ((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_IGNORED) {
+                for (int i = 0; i < nwatches; i++) {
+                    if (watches[i].wd == ev->wd) {
+                        watches[i].wd = -1;
+                    }
+                    if (watches[i].parent_wd == ev->wd) {
+                        watches[i].parent_wd = -1;
+                    }
+                }
+            } else if (watched_event(ev)) {
+                // An overflow means changes were missed, so counts too
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].wd < 0 && rewatch(&watches[i])) {
+            changed = true;
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,10 @@
+#ifndef REPEAT_WATCH_H
+#define REPEAT_WATCH_H
+
+#include <stdbool.h>
+
+bool watch_add(const char *path);
+int watch_init(void);
+bool watch_read(void);
+
+#endif